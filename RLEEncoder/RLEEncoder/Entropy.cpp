@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <queue>
+#include "Entropy.h"
+
+using namespace std;
+
+namespace
+{
+    // Short enough that the decode table stays in cache, unless there are too many symbols for it
+    const int preferred_max_length = 12;
+
+    /*
+    * Code lengths for a Huffman tree built over counts
+    */
+    vector<int> tree_lengths(const vector<uint64_t>& counts)
+    {
+        typedef pair<uint64_t, int> Node; // weight, node
+        priority_queue<Node, vector<Node>, greater<Node>> queue;
+        vector<int> parents(counts.size(), -1);
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            queue.push(Node(counts[i], (int)i));
+        }
+
+        while (queue.size() > 1)
+        {
+            Node a = queue.top();
+            queue.pop();
+            Node b = queue.top();
+            queue.pop();
+
+            int parent = (int)parents.size();
+            parents.push_back(-1);
+            parents[a.second] = parent;
+            parents[b.second] = parent;
+            queue.push(Node(a.first + b.first, parent));
+        }
+
+        vector<int> lengths;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            int length = 0;
+            for (int node = (int)i; parents[node] != -1; node = parents[node])
+            {
+                length++;
+            }
+
+            lengths.push_back(max(length, 1));
+        }
+
+        return lengths;
+    }
+}
+
+HuffmanCode::HuffmanCode(const vector<uint16_t>& symbols)
+{
+    vector<uint64_t> all_counts(0x10000);
+    for (uint16_t symbol : symbols)
+    {
+        all_counts[symbol]++;
+    }
+
+    vector<uint16_t> used;
+    vector<uint64_t> counts;
+    for (size_t symbol = 0; symbol < all_counts.size(); symbol++)
+    {
+        if (all_counts[symbol])
+        {
+            used.push_back((uint16_t)symbol);
+            counts.push_back(all_counts[symbol]);
+        }
+    }
+
+    int limit = preferred_max_length;
+    while (((size_t)1 << limit) < used.size())
+    {
+        limit++;
+    }
+
+    // Flattening the counts until the tree is shallow enough costs a little compression on rare symbols, and always
+    // gets there since equal counts make a balanced tree
+    vector<int> lengths = tree_lengths(counts);
+    while (!lengths.empty() && *max_element(lengths.begin(), lengths.end()) > limit)
+    {
+        for (auto& count : counts)
+        {
+            count = (count >> 1) | 1;
+        }
+
+        lengths = tree_lengths(counts);
+    }
+
+    for (size_t i = 0; i < used.size(); i++)
+    {
+        m_lengths.push_back(make_pair(used[i], (uint8_t)lengths[i]));
+    }
+
+    sort(m_lengths.begin(), m_lengths.end(), [](const pair<uint16_t, uint8_t>& a, const pair<uint16_t, uint8_t>& b)
+    {
+        return a.second != b.second ? a.second < b.second : a.first < b.first;
+    });
+
+    assign_codes();
+}
+
+HuffmanCode::HuffmanCode(const vector<pair<uint16_t, uint8_t>>& lengths)
+    : m_lengths(lengths)
+{
+    assign_codes();
+}
+
+/*
+* Canonical codes: counting up in order of length, then symbol, shifting left whenever the length grows
+*/
+void HuffmanCode::assign_codes()
+{
+    m_max_length = 1;
+    for (auto& entry : m_lengths)
+    {
+        m_max_length = max(m_max_length, (int)entry.second);
+    }
+
+    m_codes.assign(0x10000, 0);
+    m_table.assign((size_t)1 << m_max_length, 0);
+    uint32_t code = 0;
+    int length = 0;
+    for (auto& entry : m_lengths)
+    {
+        if (entry.second < 1 || entry.second > 16)
+        {
+            continue;
+        }
+
+        code <<= entry.second - length;
+        length = entry.second;
+
+        // Lengths that don't make a prefix code leave the rest of the table empty, so decoding them fails
+        if (code >> length)
+        {
+            break;
+        }
+
+        m_codes[entry.first] = code << 8 | length;
+        int spare = m_max_length - length;
+        for (uint32_t i = 0; i < (1u << spare); i++)
+        {
+            m_table[code << spare | i] = (uint32_t)entry.first << 8 | length;
+        }
+
+        code++;
+    }
+}
+
+void HuffmanCode::encode(const vector<uint16_t>& symbols, vector<uint8_t>& bits, uint64_t& bit_count) const
+{
+    // Pick up where the last byte left off
+    uint64_t pending = 0;
+    int pending_bits = bit_count % 8;
+    if (pending_bits)
+    {
+        pending = bits.back() >> (8 - pending_bits);
+        bits.pop_back();
+    }
+
+    for (uint16_t symbol : symbols)
+    {
+        uint32_t entry = m_codes[symbol];
+        int length = entry & 0xFF;
+        pending = pending << length | entry >> 8;
+        pending_bits += length;
+        bit_count += length;
+        while (pending_bits >= 8)
+        {
+            pending_bits -= 8;
+            bits.push_back((uint8_t)(pending >> pending_bits));
+        }
+    }
+
+    if (pending_bits)
+    {
+        bits.push_back((uint8_t)(pending << (8 - pending_bits)));
+    }
+}
+
+bool HuffmanCode::decode(const vector<uint8_t>& bits, uint64_t bit_count, uint64_t bit_offset, size_t count, vector<uint16_t>& symbols) const
+{
+    uint64_t position = bit_offset;
+    for (size_t i = 0; i < count; i++)
+    {
+        // The longest code plus the bit offset into the first byte fits in the next three bytes
+        size_t byte = (size_t)(position / 8);
+        uint32_t window = 0;
+        for (size_t b = byte; b < byte + 3; b++)
+        {
+            window = window << 8 | (b < bits.size() ? bits[b] : 0);
+        }
+
+        window = (window >> (24 - position % 8 - m_max_length)) & ((1u << m_max_length) - 1);
+        uint32_t entry = m_table[window];
+        int length = entry & 0xFF;
+        if (!length || position + length > bit_count)
+        {
+            return false;
+        }
+
+        symbols.push_back((uint16_t)(entry >> 8));
+        position += length;
+    }
+
+    return true;
+}
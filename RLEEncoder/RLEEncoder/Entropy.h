@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+* A static canonical Huffman code over 16 bit symbols, built per map from the symbols it'll code.  Code lengths are
+* capped so that decoding is one lookup into a table indexed by the next max_length() bits of the stream.
+*/
+class HuffmanCode
+{
+public:
+    // Every symbol that shows up gets a code
+    explicit HuffmanCode(const std::vector<std::uint16_t>& symbols);
+    // Symbol and code length pairs, in the canonical order lengths() gives them back in
+    explicit HuffmanCode(const std::vector<std::pair<std::uint16_t, std::uint8_t>>& lengths);
+
+    // Append the codes for symbols to a most significant bit first stream, bit_count bits of which are already used
+    void encode(const std::vector<std::uint16_t>& symbols, std::vector<std::uint8_t>& bits, std::uint64_t& bit_count) const;
+    // Decode count symbols starting at bit_offset; false if the stream runs out or holds a code that isn't in the table
+    bool decode(const std::vector<std::uint8_t>& bits, std::uint64_t bit_count, std::uint64_t bit_offset, std::size_t count, std::vector<std::uint16_t>& symbols) const;
+
+    const std::vector<std::pair<std::uint16_t, std::uint8_t>>& lengths() const { return m_lengths; }
+    int max_length() const { return m_max_length; }
+
+private:
+    void assign_codes();
+
+    std::vector<std::pair<std::uint16_t, std::uint8_t>> m_lengths; // sorted by length, then symbol
+    int m_max_length = 1;
+    std::vector<std::uint32_t> m_codes; // indexed by symbol: code << 8 | length, 0 for no code
+    std::vector<std::uint32_t> m_table; // indexed by the next m_max_length bits: symbol << 8 | length, 0 for no code
+};
@@ -2,293 +2,4441 @@
 //
 
 #include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <numeric>
 #include <set>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include "include/bitmap.h"
 #include "include/cxxopts/cxxopts.hpp"
+#include "Entropy.h"
+#include "RegionSplitter.h"
+#include "RLEEncoder.h"
+#include "StripCache.h"
+#include "TileMerger.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 using namespace std;
 
-/*
-* Converts a vector of chars to a string representation ready for concatination.
-* e.g. 0x01, 0xA3, 0xFF -> "$01", "$A3", "$FF"
-*/
-void chars_to_hex(const vector<char>& input, vector<string>& output)
-{
-    for (auto& el : input)
+/*
+* Converts a vector of chars to a string representation ready for concatination, two hex digits per byte of Word.
+* e.g. 0x01, 0xA3, 0xFF -> "$01", "$A3", "$FF"
+*/
+template <typename Word>
+void chars_to_hex(const vector<Word>& input, vector<string>& output)
+{
+    for (auto& el : input)
+    {
+        stringstream ss;
+        ss << "$";
+        ss << setfill('0') << setw(2 * sizeof(Word)) << uppercase << hex << (unsigned int)(typename make_unsigned<Word>::type)el;
+        output.push_back(ss.str());
+    }
+}
+
+/*
+* Turn encoded words into a line of hex for output
+*/
+template <typename Word>
+string format_coding(const vector<Word>& encoded)
+{
+    vector<string> converted_values;
+    chars_to_hex(encoded, converted_values);
+
+    stringstream ss;
+    for_each(converted_values.begin(), converted_values.end(), [&ss](string& s) { ss << s << ", "; });
+    string retval = ss.str();
+    // erase trailing ", "
+    retval.pop_back();
+    retval.pop_back();
+
+    return retval;
+}
+
+/*
+* Turn plain codes (tables rather than encoded strips) into a line of hex at the output code width
+*/
+string format_codes(const vector<TileCode>& codes, int code_width)
+{
+    if (code_width == 16)
+    {
+        return format_coding(codes);
+    }
+
+    return format_coding(vector<uint8_t>(codes.begin(), codes.end()));
+}
+
+/*
+* How tile strings are laid out.  Truecolor maps use three chars per pixel; indexed maps keep one palette index per
+* pixel, so their tiles are a third of the size to hash and compare and never get expanded to RGBA at all.  With a
+* depth set the indices are packed down further, e.g. a 16x16 tile at 2 bits per pixel is a 64 byte string.
+*/
+struct TileFormat
+{
+    bool indexed = false;
+    bool relative = false; // indices are into each tile's own palette rather than the map's
+    int depth = 0; // bits per pixel the indices are packed to, 0 to leave them a char each
+    vector<BGRA> palette;
+    unordered_map<uint32_t, uint8_t> palette_lookup;
+};
+
+uint32_t pack_color(uint8_t red, uint8_t green, uint8_t blue)
+{
+    return (red << 16) | (green << 8) | blue;
+}
+
+void set_palette(TileFormat& format, const vector<BGRA>& palette)
+{
+    format.palette = palette;
+    format.palette_lookup.clear();
+    for (size_t i = 0; i < palette.size(); i++)
+    {
+        // First entry wins if a palette repeats a color
+        format.palette_lookup.emplace(pack_color(palette[i].Red, palette[i].Green, palette[i].Blue), (uint8_t)i);
+    }
+}
+
+/*
+* Whether two formats have the same colors in the same order, so their indices mean the same thing
+*/
+bool same_palette(const TileFormat& a, const TileFormat& b)
+{
+    return equal(a.palette.begin(), a.palette.end(), b.palette.begin(), b.palette.end(),
+        [](const BGRA& x, const BGRA& y) { return x.Red == y.Red && x.Green == y.Green && x.Blue == y.Blue; });
+}
+
+/*
+* Indexed maps use their own palette.  A truecolor map that has to be packed gets a palette built from its colors in
+* the order they first show up.
+*/
+bool get_tile_format(CBitmap& bitmap, int depth, TileFormat& format)
+{
+    format = TileFormat();
+    format.depth = depth;
+    if (bitmap.IsIndexed())
+    {
+        format.indexed = true;
+        set_palette(format, vector<BGRA>(bitmap.GetColorTable(), bitmap.GetColorTable() + bitmap.GetColorTableSize()));
+        return true;
+    }
+
+    if (depth == 0)
+    {
+        return true;
+    }
+
+    format.indexed = true;
+    vector<BGRA> palette;
+    set<uint32_t> seen;
+    RGBA* bits = (RGBA*)bitmap.GetBits();
+    int upper_left = (bitmap.GetHeight() - 1) * bitmap.GetWidth();
+    for (int i = upper_left; i >= 0; i -= bitmap.GetWidth())
+    {
+        for (int j = i; j < i + (int)bitmap.GetWidth(); j++)
+        {
+            if (seen.insert(pack_color(bits[j].Red, bits[j].Green, bits[j].Blue)).second)
+            {
+                if (palette.size() == 256)
+                {
+                    cout << "Map has more than 256 colors so it can't be packed" << endl;
+                    return false;
+                }
+
+                palette.push_back(BGRA{ bits[j].Blue, bits[j].Green, bits[j].Red, 0 });
+            }
+        }
+    }
+
+    set_palette(format, palette);
+    return true;
+}
+
+// An NES attribute gives a square of this many pixels one palette of this many colors
+const int attribute_size = 16;
+const size_t attribute_colors = 4;
+
+/*
+* A color's cell in the quantization lookup table, six bits per channel
+*/
+size_t color_cell(uint8_t red, uint8_t green, uint8_t blue)
+{
+    return (size_t)(red >> 2) << 12 | (size_t)(green >> 2) << 6 | blue >> 2;
+}
+
+/*
+* The nearest palette entry to the middle of every cell of the lookup table.  A palette color's own cell always maps to
+* it, so colors already in the palette come through exactly.
+*/
+vector<uint8_t> build_quantize_table(const vector<BGRA>& palette)
+{
+    vector<uint8_t> table((size_t)1 << 18);
+    parallel_for(64, [&](size_t r) {
+        int red = (int)r * 4 + 2;
+        for (int g = 0; g < 64; g++)
+        {
+            int green = g * 4 + 2;
+            for (int b = 0; b < 64; b++)
+            {
+                int blue = b * 4 + 2;
+                int best = numeric_limits<int>::max();
+                for (size_t i = 0; i < palette.size(); i++)
+                {
+                    int dr = red - palette[i].Red;
+                    int dg = green - palette[i].Green;
+                    int db = blue - palette[i].Blue;
+                    int distance = dr * dr + dg * dg + db * db;
+                    if (distance < best)
+                    {
+                        best = distance;
+                        table[r << 12 | g << 6 | b] = (uint8_t)i;
+                    }
+                }
+            }
+        }
+    });
+
+    // Backwards so the first of two palette colors sharing a cell wins, the same as palette_lookup
+    for (size_t i = palette.size(); i-- > 0;)
+    {
+        table[color_cell(palette[i].Red, palette[i].Green, palette[i].Blue)] = (uint8_t)i;
+    }
+
+    return table;
+}
+
+/*
+* Four colors for a map that wasn't given a palette: k-means over the map's colors, weighted by how many pixels use each,
+* starting from the most used color and then whichever is most used relative to how close it is to the ones picked so
+* far.  Stray colors from anti-aliasing or noise end up pulled into the big clusters instead of getting colors of their
+* own.  Most used first.
+*/
+vector<BGRA> detect_palette(CBitmap& bitmap)
+{
+    const size_t palette_size = 4;
+    const int iterations = 8;
+
+    unordered_map<uint32_t, size_t> counts;
+    size_t pixels = (size_t)bitmap.GetWidth() * bitmap.GetHeight();
+    for (size_t i = 0; i < pixels; i++)
+    {
+        if (bitmap.IsIndexed())
+        {
+            const BGRA& color = bitmap.GetColorTable()[bitmap.GetIndices()[i]];
+            counts[pack_color(color.Red, color.Green, color.Blue)]++;
+        }
+        else
+        {
+            const RGBA& color = ((RGBA*)bitmap.GetBits())[i];
+            counts[pack_color(color.Red, color.Green, color.Blue)]++;
+        }
+    }
+
+    vector<pair<uint32_t, size_t>> colors(counts.begin(), counts.end());
+    sort(colors.begin(), colors.end(), [](const pair<uint32_t, size_t>& a, const pair<uint32_t, size_t>& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    auto channel = [](uint32_t color, int shift) { return (double)((color >> shift) & 0xFF); };
+    auto distance = [&](uint32_t color, const double* center) {
+        double dr = channel(color, 16) - center[0];
+        double dg = channel(color, 8) - center[1];
+        double db = channel(color, 0) - center[2];
+        return dr * dr + dg * dg + db * db;
+    };
+
+    vector<array<double, 3>> centers;
+    while (centers.size() < min(palette_size, colors.size()))
+    {
+        uint32_t pick = colors[0].first;
+        double best = -1;
+        for (size_t i = 0; i < colors.size() && !centers.empty(); i++)
+        {
+            double nearest = numeric_limits<double>::max();
+            for (auto& center : centers)
+            {
+                nearest = min(nearest, distance(colors[i].first, center.data()));
+            }
+
+            if (nearest * colors[i].second > best)
+            {
+                best = nearest * colors[i].second;
+                pick = colors[i].first;
+            }
+        }
+
+        centers.push_back({ channel(pick, 16), channel(pick, 8), channel(pick, 0) });
+    }
+
+    vector<size_t> uses(centers.size());
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        vector<array<double, 3>> sums(centers.size(), { 0, 0, 0 });
+        fill(uses.begin(), uses.end(), 0);
+        for (auto& color : colors)
+        {
+            size_t nearest = 0;
+            for (size_t c = 1; c < centers.size(); c++)
+            {
+                if (distance(color.first, centers[c].data()) < distance(color.first, centers[nearest].data()))
+                {
+                    nearest = c;
+                }
+            }
+
+            sums[nearest][0] += channel(color.first, 16) * color.second;
+            sums[nearest][1] += channel(color.first, 8) * color.second;
+            sums[nearest][2] += channel(color.first, 0) * color.second;
+            uses[nearest] += color.second;
+        }
+
+        for (size_t c = 0; c < centers.size(); c++)
+        {
+            for (int i = 0; i < 3 && uses[c]; i++)
+            {
+                centers[c][i] = sums[c][i] / uses[c];
+            }
+        }
+    }
+
+    vector<size_t> order(centers.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return uses[a] > uses[b]; });
+
+    vector<BGRA> palette;
+    for (size_t c : order)
+    {
+        palette.push_back(BGRA{ (uint8_t)lround(centers[c][2]), (uint8_t)lround(centers[c][1]), (uint8_t)lround(centers[c][0]), 0 });
+    }
+
+    return palette;
+}
+
+/*
+* Snap every pixel of the map to its nearest palette color through the lookup table and swap the map for the palette
+* indices, so it goes through the indexed tile path like any indexed map.  The same pass checks every 16x16 attribute
+* area, lined up with the tile grid, for more than the 4 colors an NES attribute can give it.
+*/
+bool quantize_map(CBitmap& bitmap, const vector<BGRA>& palette, int offset_x, int offset_y)
+{
+    vector<uint8_t> table = build_quantize_table(palette);
+    int width = bitmap.GetWidth();
+    int height = bitmap.GetHeight();
+
+    // An indexed map only needs its color table looked up
+    vector<uint8_t> entries;
+    if (bitmap.IsIndexed())
+    {
+        for (unsigned int i = 0; i < bitmap.GetColorTableSize(); i++)
+        {
+            const BGRA& color = bitmap.GetColorTable()[i];
+            entries.push_back(table[color_cell(color.Red, color.Green, color.Blue)]);
+        }
+
+        entries.resize(256, 0);
+    }
+
+    // Bands of attribute rows are independent; the first band also takes any rows above the grid
+    int bands = max(1, (height - offset_y + attribute_size - 1) / attribute_size);
+    int areas_across = (width - offset_x + attribute_size - 1) / attribute_size;
+    vector<uint8_t> indices((size_t)width * height);
+    vector<vector<string>> failures(bands);
+    parallel_for(bands, [&](size_t band) {
+        vector<bitset<256>> used(areas_across);
+        int top = band ? offset_y + (int)band * attribute_size : 0;
+        int bottom = min(height, offset_y + ((int)band + 1) * attribute_size);
+        for (int y = top; y < bottom; y++)
+        {
+            // Bitmaps index from the lower left
+            size_t row = (size_t)(height - 1 - y) * width;
+            for (int x = 0; x < width; x++)
+            {
+                uint8_t index;
+                if (bitmap.IsIndexed())
+                {
+                    index = entries[bitmap.GetIndices()[row + x]];
+                }
+                else
+                {
+                    const RGBA& color = ((RGBA*)bitmap.GetBits())[row + x];
+                    index = table[color_cell(color.Red, color.Green, color.Blue)];
+                }
+
+                indices[row + x] = index;
+                if (y >= offset_y && x >= offset_x)
+                {
+                    used[(x - offset_x) / attribute_size].set(index);
+                }
+            }
+        }
+
+        for (int area = 0; area < areas_across; area++)
+        {
+            if (used[area].count() > attribute_colors)
+            {
+                stringstream ss;
+                ss << "Attribute area at (" << area << ", " << band << ") uses " << used[area].count() << " colors after quantizing, more than " << attribute_colors;
+                failures[band].push_back(ss.str());
+            }
+        }
+    });
+
+    bool fits = true;
+    for (auto& band : failures)
+    {
+        for (auto& failure : band)
+        {
+            cout << failure << endl;
+            fits = false;
+        }
+    }
+
+    return fits && bitmap.SetIndexedBits(indices.data(), width, height, palette.data(), (unsigned int)palette.size());
+}
+
+/*
+* Stringify a tile for easy comparison
+*/
+string make_tile_string(const RGBA* bit_start, int width, int tile_size)
+{
+    stringstream ss;
+    for (int i = 0; i > -tile_size * width; i -= width)
+    {
+        for (int j = i; j < i + tile_size; j++)
+        {
+            const RGBA* pixel = bit_start + j;
+            // Pixel will be converted to three chars in a string, which easily can be turned back into a bitmap with no alpha channel
+            ss << pixel->Red << pixel->Green << pixel->Blue;
+        }
+    }
+
+    return ss.str();
+}
+
+/*
+* Stringify a tile of palette indices, one char per pixel
+*/
+string make_indexed_tile_string(const uint8_t* bit_start, int width, int tile_size)
+{
+    string tile(tile_size * tile_size, '\0');
+    char* out = &tile[0];
+    for (int i = 0; i > -tile_size * width; i -= width)
+    {
+        memcpy(out, bit_start + i, tile_size);
+        out += tile_size;
+    }
+
+    return tile;
+}
+
+/*
+* Stringify a truecolor tile as indices into the palette of an indexed map, so tiles from a mapping file can be compared
+* against it.  Fails if the tile uses a color the palette doesn't have.
+*/
+bool make_palette_tile_string(const RGBA* bit_start, int width, int tile_size, const TileFormat& format, string& tile)
+{
+    tile.clear();
+    for (int i = 0; i > -tile_size * width; i -= width)
+    {
+        for (int j = i; j < i + tile_size; j++)
+        {
+            const RGBA* pixel = bit_start + j;
+            auto match = format.palette_lookup.find(pack_color(pixel->Red, pixel->Green, pixel->Blue));
+            if (match == format.palette_lookup.end())
+            {
+                return false;
+            }
+
+            tile.push_back((char)match->second);
+        }
+    }
+
+    return true;
+}
+
+/*
+* Pack a tile of one char indices down to depth bits per pixel, first pixel in the high bits
+*/
+string pack_tile_string(const string& tile, int depth)
+{
+    int per_byte = 8 / depth;
+    string packed((tile.size() + per_byte - 1) / per_byte, '\0');
+    for (size_t i = 0; i < tile.size(); i++)
+    {
+        int shift = 8 - depth * (int)(i % per_byte + 1);
+        packed[i / per_byte] |= (char)((uint8_t)tile[i] << shift);
+    }
+
+    return packed;
+}
+
+string unpack_tile_string(const string& packed, int depth, int pixels)
+{
+    int per_byte = 8 / depth;
+    string tile(pixels, '\0');
+    for (int i = 0; i < pixels; i++)
+    {
+        int shift = 8 - depth * (i % per_byte + 1);
+        tile[i] = (char)(((uint8_t)packed[i / per_byte] >> shift) & ((1 << depth) - 1));
+    }
+
+    return tile;
+}
+
+/*
+* Make sure every index in a tile fits in the packed depth, explaining why not if it doesn't
+*/
+bool check_tile_depth(const string& tile, int depth, const string& description)
+{
+    set<uint8_t> colors(tile.begin(), tile.end());
+    if (*colors.rbegin() < (1 << depth))
+    {
+        return true;
+    }
+
+    if (colors.size() > (size_t)(1 << depth))
+    {
+        cout << description << " uses " << colors.size() << " colors, more than " << depth << " bits per pixel allows" << endl;
+    }
+    else
+    {
+        cout << description << " uses palette entry " << (int)*colors.rbegin() << ", which doesn't fit in " << depth << " bits per pixel" << endl;
+    }
+
+    return false;
+}
+
+/*
+* A tile string's pixels as one value each, palette index or packed color, for looking at tiles pixel by pixel
+*/
+vector<uint32_t> tile_pixels(const string& tile, const TileFormat& format, int tile_size)
+{
+    string pixels = format.depth ? unpack_tile_string(tile, format.depth, tile_size * tile_size) : tile;
+    vector<uint32_t> values;
+    if (format.indexed)
+    {
+        values.assign((const uint8_t*)pixels.data(), (const uint8_t*)pixels.data() + pixels.size());
+        return values;
+    }
+
+    for (size_t i = 0; i + 2 < pixels.size(); i += 3)
+    {
+        values.push_back(pack_color(pixels[i], pixels[i + 1], pixels[i + 2]));
+    }
+
+    return values;
+}
+
+/*
+* Stringify the tile of the map starting at offset in the map's tile format
+*/
+bool make_map_tile_string(CBitmap& bitmap, const TileFormat& format, int offset, int tile_size, string& tile)
+{
+    if (bitmap.IsIndexed())
+    {
+        tile = make_indexed_tile_string(bitmap.GetIndices() + offset, bitmap.GetWidth(), tile_size);
+    }
+    else if (format.indexed)
+    {
+        // The palette was built from the map, so only another bitmap read the same way, like a frame, can miss a color
+        if (!make_palette_tile_string((RGBA*)bitmap.GetBits() + offset, bitmap.GetWidth(), tile_size, format, tile))
+        {
+            cout << "Tile at (" << offset % bitmap.GetWidth() / tile_size << ", " << (bitmap.GetHeight() - 1 - offset / bitmap.GetWidth()) / tile_size << ") uses a color the map doesn't" << endl;
+            return false;
+        }
+    }
+    else
+    {
+        tile = make_tile_string((RGBA*)bitmap.GetBits() + offset, bitmap.GetWidth(), tile_size);
+        return true;
+    }
+
+    if (format.depth)
+    {
+        stringstream ss;
+        ss << "Tile at (" << offset % bitmap.GetWidth() / tile_size << ", " << (bitmap.GetHeight() - 1 - offset / bitmap.GetWidth()) / tile_size << ")";
+        if (!check_tile_depth(tile, format.depth, ss.str()))
+        {
+            return false;
+        }
+
+        tile = pack_tile_string(tile, format.depth);
+    }
+
+    return true;
+}
+
+/*
+* Mirror a tile string.  Flip bit 0 mirrors horizontally and bit 1 vertically.
+*/
+string flip_tile_string(const string& tile, const TileFormat& format, int tile_size, int flip)
+{
+    if (!flip)
+    {
+        return tile;
+    }
+
+    string pixels = format.depth ? unpack_tile_string(tile, format.depth, tile_size * tile_size) : tile;
+    int unit = format.indexed ? 1 : 3;
+    string flipped(pixels.size(), '\0');
+    for (int y = 0; y < tile_size; y++)
+    {
+        int from_y = flip & 2 ? tile_size - 1 - y : y;
+        for (int x = 0; x < tile_size; x++)
+        {
+            int from_x = flip & 1 ? tile_size - 1 - x : x;
+            memcpy(&flipped[(y * tile_size + x) * unit], &pixels[(from_y * tile_size + from_x) * unit], unit);
+        }
+    }
+
+    return format.depth ? pack_tile_string(flipped, format.depth) : flipped;
+}
+
+/*
+* The canonical form of a tile is the smallest of its four flips.  Returns it along with the flip that turns it back
+* into the tile we started with (flips undo themselves, so that's the same flip that got us there).
+*/
+pair<string, char> canonical_flip(const string& tile, const TileFormat& format, int tile_size)
+{
+    pair<string, char> canonical(tile, 0);
+    for (int flip = 1; flip < 4; flip++)
+    {
+        string flipped = flip_tile_string(tile, format, tile_size, flip);
+        if (flipped < canonical.first)
+        {
+            canonical = make_pair(flipped, (char)flip);
+        }
+    }
+
+    return canonical;
+}
+
+/*
+* A hash that comes out the same for all four flips of a tile: each pixel is mixed with its distance from the nearest
+* edge in each direction, which mirroring doesn't change, and the results are summed so their order doesn't matter.
+*/
+uint64_t flip_invariant_hash(const string& tile, const TileFormat& format, int tile_size)
+{
+    string pixels = format.depth ? unpack_tile_string(tile, format.depth, tile_size * tile_size) : tile;
+    int unit = format.indexed ? 1 : 3;
+    uint64_t hash = 0;
+    for (int y = 0; y < tile_size; y++)
+    {
+        uint64_t edge_y = min(y, tile_size - 1 - y);
+        for (int x = 0; x < tile_size; x++)
+        {
+            uint64_t edge_x = min(x, tile_size - 1 - x);
+            uint64_t value = 0;
+            memcpy(&value, &pixels[(y * tile_size + x) * unit], unit);
+
+            // splitmix64 finalizer
+            uint64_t mixed = value ^ (edge_x << 32) ^ (edge_y << 48);
+            mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ull;
+            mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBull;
+            hash += mixed ^ (mixed >> 31);
+        }
+    }
+
+    return hash;
+}
+
+/*
+* Replace every tile with its canonical flip and record which flip gets each one back.  Repeats of a tile we've seen
+* are a single lookup; a new tile is checked against the canonical tiles that share its flip invariant hash, so we
+* only build all four flips of a tile the first time it shows up in any orientation.
+*/
+void canonicalize_flips(vector<string>& tiles, const TileFormat& format, int tile_size, vector<TileCode>& flips)
+{
+    unordered_map<string, pair<string, char>> seen;
+    unordered_map<uint64_t, vector<string>> canonical_tiles;
+
+    flips.clear();
+    for (auto& tile : tiles)
+    {
+        auto match = seen.find(tile);
+        if (match == seen.end())
+        {
+            pair<string, char> canonical;
+            bool found = false;
+            auto& candidates = canonical_tiles[flip_invariant_hash(tile, format, tile_size)];
+            for (auto& candidate : candidates)
+            {
+                for (int flip = 0; flip < 4 && !found; flip++)
+                {
+                    if (flip_tile_string(candidate, format, tile_size, flip) == tile)
+                    {
+                        canonical = make_pair(candidate, (char)flip);
+                        found = true;
+                    }
+                }
+
+                if (found)
+                {
+                    break;
+                }
+            }
+
+            if (!found)
+            {
+                canonical = canonical_flip(tile, format, tile_size);
+                candidates.push_back(canonical.first);
+            }
+
+            match = seen.emplace(tile, canonical).first;
+        }
+
+        flips.push_back(match->second.second);
+        tile = match->second.first;
+    }
+}
+
+/*
+* A tile with its colors swapped for indices into its own palette, which is kept as the colors in order of first
+* appearance in the tile's source format
+*/
+struct RelativeTile
+{
+    string tile;
+    string palette;
+    char flip = 0;
+};
+
+string make_relative_tile_string(const string& tile, const TileFormat& source_format, string& palette)
+{
+    int unit = source_format.indexed ? 1 : 3;
+    string relative;
+    palette.clear();
+    for (size_t i = 0; i < tile.size(); i += unit)
+    {
+        size_t index = 0;
+        while (index < palette.size() && palette.compare(index, unit, tile, i, unit) != 0)
+        {
+            index += unit;
+        }
+
+        if (index == palette.size())
+        {
+            palette.append(tile, i, unit);
+        }
+
+        relative.push_back((char)(index / unit));
+    }
+
+    return relative;
+}
+
+/*
+* Make the palette relative form of a tile from its source format, packed to format's depth.  With flips the smallest
+* of the four flips wins, remapping each one on its own since mirroring changes which color shows up first.
+*/
+bool make_relative_tile(const string& tile, const TileFormat& source_format, const TileFormat& format, int tile_size, bool flips, const string& description, RelativeTile& relative)
+{
+    for (int flip = 0; flip < (flips ? 4 : 1); flip++)
+    {
+        string palette;
+        string candidate = make_relative_tile_string(flip_tile_string(tile, source_format, tile_size, flip), source_format, palette);
+        if (flip == 0 || candidate < relative.tile)
+        {
+            relative.tile = candidate;
+            relative.palette = palette;
+            relative.flip = (char)flip;
+        }
+    }
+
+    if (format.depth)
+    {
+        if (!check_tile_depth(relative.tile, format.depth, description))
+        {
+            return false;
+        }
+
+        relative.tile = pack_tile_string(relative.tile, format.depth);
+    }
+
+    return true;
+}
+
+/*
+* Replace every tile with its palette relative form and give each distinct palette an ID.  Each palette comes out as a
+* line of its colors in the map's source format: palette indices for indexed maps, red/green/blue bytes otherwise.
+* format is updated to describe the new tile strings, with a grayscale ramp standing in for the palette when tiles
+* are output.
+*/
+bool canonicalize_palettes(vector<string>& tiles, int width, int tile_size, int depth, TileFormat& format, vector<TileCode>& palette_ids, vector<TileCode>* flips, vector<string>& palette_lines)
+{
+    TileFormat source_format = format;
+    format.indexed = true;
+    format.relative = true;
+    format.depth = depth;
+
+    unordered_map<string, RelativeTile> seen;
+    map<string, TileCode> palette_codes;
+    vector<string> palettes;
+    size_t most_colors = 2;
+
+    palette_ids.clear();
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        auto match = seen.find(tiles[i]);
+        if (match == seen.end())
+        {
+            RelativeTile relative;
+            stringstream ss;
+            ss << "Tile at (" << i % width << ", " << i / width << ")";
+            if (!make_relative_tile(tiles[i], source_format, format, tile_size, flips != nullptr, ss.str(), relative))
+            {
+                return false;
+            }
+
+            match = seen.emplace(tiles[i], relative).first;
+        }
+
+        const RelativeTile& relative = match->second;
+        auto palette = palette_codes.find(relative.palette);
+        if (palette == palette_codes.end())
+        {
+            if (palettes.size() == 256)
+            {
+                cout << "Too many palettes, more than 256 different palettes are used" << endl;
+                return false;
+            }
+
+            palette = palette_codes.emplace(relative.palette, (TileCode)palettes.size()).first;
+            palettes.push_back(relative.palette);
+            most_colors = max(most_colors, relative.palette.size() / (source_format.indexed ? 1 : 3));
+        }
+
+        palette_ids.push_back(palette->second);
+        if (flips)
+        {
+            flips->push_back(relative.flip);
+        }
+
+        tiles[i] = relative.tile;
+    }
+
+    palette_lines.clear();
+    for (auto& palette : palettes)
+    {
+        palette_lines.push_back(format_coding(vector<char>(palette.begin(), palette.end())));
+    }
+
+    // Spread a gray ramp over however many colors a tile can have so tile bitmaps still show the shapes
+    size_t ramp_size = depth ? (size_t)1 << depth : most_colors;
+    vector<BGRA> ramp;
+    for (size_t i = 0; i < ramp_size; i++)
+    {
+        uint8_t level = (uint8_t)(i * 255 / (ramp_size - 1));
+        ramp.push_back(BGRA{ level, level, level, 0 });
+    }
+
+    set_palette(format, ramp);
+    return true;
+}
+
+/*
+* Output a bitmap for a stringified tile
+*/
+void output_bitmap(const string& tile, TileCode code, int tile_size, const string& output_base, const TileFormat& format)
+{
+    stringstream ss;
+    ss << output_base << "-tile" << code << ".bmp";
+
+    if (format.indexed)
+    {
+        string unpacked = format.depth ? unpack_tile_string(tile, format.depth, tile_size * tile_size) : tile;
+
+        // Indexed tiles go straight back out as indices, bottom row first
+        vector<uint8_t> indices;
+        for (int i = (tile_size - 1) * tile_size; i >= 0; i -= tile_size)
+        {
+            indices.insert(indices.end(), unpacked.begin() + i, unpacked.begin() + i + tile_size);
+        }
+
+        CBitmap bitmap;
+        bitmap.SetIndexedBits(indices.data(), tile_size, tile_size, format.palette.data(), format.palette.size());
+        bitmap.Save(ss.str().c_str(), 8);
+        return;
+    }
+
+    // Need to reverse the order of rows back to what bitmap is expecting
+    const char* chars = tile.c_str();
+    int length = tile.size();
+    char* bits = new char[length];
+    int k = 0;
+    for (int i = (tile_size - 1) * tile_size * 3; i >= 0; i -= tile_size * 3) // * 3 because each pixel is 3 chars
+    {
+        for (int j = i; j < i + (tile_size * 3); j++)
+        {
+            bits[k] = chars[j];
+            k++;
+        }
+    }
+
+    CBitmap bitmap;
+    bitmap.SetBits(bits, tile_size, tile_size, 0x0000FF, 0x00FF00, 0xFF0000);
+    bitmap.Save(ss.str().c_str(), 24);
+    delete[] bits;
+}
+
+vector<TileCode> TileGrid::row(int y) const
+{
+    return vector<TileCode>(codes.begin() + y * width, codes.begin() + (y + 1) * width);
+}
+
+vector<TileCode> TileGrid::column(int x) const
+{
+    vector<TileCode> strip;
+    for (int y = 0; y < height; y++)
+    {
+        strip.push_back(codes[y * width + x]);
+    }
+
+    return strip;
+}
+
+/*
+* Coding is Konami RLE
+* 
+* $00-80 - The next byte is repeated n times
+* $81-FE - The next 128-n bytes are literals
+* $FF - End of stream
+* 
+* Need at least three repeated to be worth using the repeated form
+* 
+* With 16 bit words the same layout is widened to a word per header and code: $0000-7FFF runs, $8001-FFFE literals and
+* $FFFF for the end of the stream.
+* 
+* Adapted from Python example: https://github.com/sobodash/graveyardduck/blob/master/graveduck.py
+* 
+* strip - the tile codes of a single row or column, in order
+*/
+template <typename Word>
+vector<Word> rle_encode(const vector<Word>& strip)
+{
+    const size_t longest_run = numeric_limits<Word>::max() >> 1; // $7F
+    const Word literal = (Word)(longest_run + 1);               // $80
+    const Word end = numeric_limits<Word>::max();               // $FF
+
+    vector<Word> final_values;
+    vector<Word> running_tiles;
+    size_t i = 0;
+    while (i < strip.size())
+    {
+        Word tile = strip[i];
+        size_t count = 0;
+        size_t last = i;
+
+        // iterate through until we either reach the end or find a new tile
+        while (i < strip.size() && strip[i] == tile)
+        {
+            count++;
+            i++;
+        }
+
+        // only if we have at least three repeated tiles should we bother encoding as a run
+        if (count > 2)
+        {
+            // if we had a mishmash before encountering this run make sure we put that into the final first
+            if (!running_tiles.empty())
+            {
+                final_values.push_back((Word)(literal + running_tiles.size()));
+                final_values.insert(final_values.end(), running_tiles.begin(), running_tiles.end());
+            }
+
+            // a run can only be so long
+            if (count > longest_run)
+            {
+                while (count > longest_run)
+                {
+                    final_values.push_back((Word)longest_run);
+                    final_values.push_back(tile);
+                    count -= longest_run;
+                }
+            }
+
+            // encode the run and reset our state
+            final_values.push_back((Word)count);
+            final_values.push_back(tile);
+            running_tiles.clear();
+        }
+        else // need to collect the random tiles that will be literals
+        {
+            // intialize the literals
+            if (running_tiles.empty())
+            {
+                // will only ever be 1 or 2
+                running_tiles.insert(running_tiles.end(), strip.begin() + last, strip.begin() + i);
+            }
+            else // already had a collection of literals
+            {
+                // if our size is too big then we need to flush and start a new segment
+                if (running_tiles.size() > longest_run - 3)
+                {
+                    final_values.push_back((Word)(literal + running_tiles.size()));
+                    final_values.insert(final_values.end(), running_tiles.begin(), running_tiles.end());
+                    running_tiles.clear();
+                }
+
+                // will only ever be 1 or 2
+                running_tiles.insert(running_tiles.end(), strip.begin() + last, strip.begin() + i);
+            }
+        }
+    }
+
+    // get any leftover unencoded stuff
+    if (!running_tiles.empty())
+    {
+        final_values.push_back((Word)(literal + running_tiles.size()));
+        final_values.insert(final_values.end(), running_tiles.begin(), running_tiles.end());
+    }
+
+    // terminate the string
+    final_values.push_back(end);
+
+    return final_values;
+}
+
+/*
+* 6502 cycles the Konami decoder spends on each part of a stream.  Defaults are for a decoder copying straight to
+* PPUDATA with the count in X and the source indexed by Y.
+*/
+struct DecodeCosts
+{
+    int header = 22;  // fetching a run or literal header and branching on it
+    int literal = 16; // per literal: load, store, step the index and loop
+    int run = 9;      // per repeat of a run: store and loop
+    int end = 12;     // fetching the end of stream and returning
+    int unpack = 10;  // per byte of nibble packed literals: splitting it in two
+};
+
+/*
+* Cycles it takes to decode an encoded strip under the cost model
+*/
+template <typename Word>
+int decode_cycles(const vector<Word>& encoded, const DecodeCosts& costs)
+{
+    const Word literal = (Word)((numeric_limits<Word>::max() >> 1) + 1);
+    const Word end = numeric_limits<Word>::max();
+
+    int cycles = costs.end;
+    size_t i = 0;
+    while (i < encoded.size() && encoded[i] != end)
+    {
+        if (encoded[i] < literal)
+        {
+            cycles += costs.header + encoded[i] * costs.run;
+            i += 2;
+        }
+        else
+        {
+            cycles += costs.header + (encoded[i] - literal) * costs.literal;
+            i += 1 + encoded[i] - literal;
+        }
+    }
+
+    return cycles;
+}
+
+/*
+* Konami RLE that picks its runs and literals to give the smallest bytes + cycle_weight * decode cycles for the whole
+* strip rather than greedily.  Shortest paths from the end of the strip back to the start, where every run and literal
+* that could start at a tile is an edge.  Same stream format as rle_encode, so the same decoder reads it.
+*/
+template <typename Word>
+vector<Word> rle_encode_optimal(const vector<Word>& strip, const DecodeCosts& costs, double cycle_weight)
+{
+    const size_t longest_run = numeric_limits<Word>::max() >> 1; // $7F
+    const size_t longest_literal = longest_run - 1;             // $FE
+    const Word literal = (Word)(longest_run + 1);               // $80
+    const Word end = numeric_limits<Word>::max();               // $FF
+
+    size_t n = strip.size();
+
+    // How many times the tile at each spot repeats from there on
+    vector<size_t> repeats(n + 1, 0);
+    for (size_t i = n; i-- > 0;)
+    {
+        repeats[i] = i + 1 < n && strip[i + 1] == strip[i] ? repeats[i + 1] + 1 : 1;
+    }
+
+    vector<double> best(n + 1, numeric_limits<double>::infinity());
+    vector<size_t> lengths(n + 1, 0);
+    vector<bool> runs(n + 1, false);
+    best[n] = 0;
+    for (size_t i = n; i-- > 0;)
+    {
+        for (size_t length = 1; length <= min(repeats[i], longest_run); length++)
+        {
+            double cost = 2 * sizeof(Word) + cycle_weight * (costs.header + length * costs.run) + best[i + length];
+            if (cost < best[i])
+            {
+                best[i] = cost;
+                lengths[i] = length;
+                runs[i] = true;
+            }
+        }
+
+        for (size_t length = 1; length <= min(n - i, longest_literal); length++)
+        {
+            double cost = (1 + length) * sizeof(Word) + cycle_weight * (costs.header + length * costs.literal) + best[i + length];
+            if (cost < best[i])
+            {
+                best[i] = cost;
+                lengths[i] = length;
+                runs[i] = false;
+            }
+        }
+    }
+
+    vector<Word> final_values;
+    for (size_t i = 0; i < n; i += lengths[i])
+    {
+        if (runs[i])
+        {
+            final_values.push_back((Word)lengths[i]);
+            final_values.push_back(strip[i]);
+        }
+        else
+        {
+            final_values.push_back((Word)(literal + lengths[i]));
+            final_values.insert(final_values.end(), strip.begin() + i, strip.begin() + i + lengths[i]);
+        }
+    }
+
+    final_values.push_back(end);
+    return final_values;
+}
+
+/*
+* Coding is a delta against the previous strip in the same orientation, for maps where neighboring rows or columns
+* mostly match
+*
+* $00-7F - Copy the next n tiles from the previous strip
+* $81-FE - The next 128-n bytes are literals
+* $FF - End of stream
+*
+* 16 bit words widen it the same way as Konami RLE.  The first strip is coded against a strip of zeros.
+*
+* strip - the tile codes of a single row or column, in order
+* previous - the row above or column to the left, the same length as strip
+*/
+template <typename Word>
+vector<Word> delta_encode(const vector<Word>& strip, const vector<Word>& previous)
+{
+    const size_t longest_copy = numeric_limits<Word>::max() >> 1; // $7F
+    const size_t longest_patch = longest_copy - 1;               // $FE
+    const Word literal = (Word)(longest_copy + 1);               // $80
+    const Word end = numeric_limits<Word>::max();                // $FF
+
+    vector<Word> final_values;
+    vector<Word> patch;
+    auto flush_patch = [&]() {
+        if (!patch.empty())
+        {
+            final_values.push_back((Word)(literal + patch.size()));
+            final_values.insert(final_values.end(), patch.begin(), patch.end());
+            patch.clear();
+        }
+    };
+
+    size_t i = 0;
+    while (i < strip.size())
+    {
+        size_t matches = 0;
+        while (i + matches < strip.size() && strip[i + matches] == previous[i + matches])
+        {
+            matches++;
+        }
+
+        // Copying out of the middle of a patch costs a header on either side, so it has to save at least two tiles
+        if (matches >= (patch.empty() ? 1u : 2u))
+        {
+            flush_patch();
+            while (matches)
+            {
+                size_t count = min(matches, longest_copy);
+                final_values.push_back((Word)count);
+                i += count;
+                matches -= count;
+            }
+
+            continue;
+        }
+
+        patch.push_back(strip[i++]);
+        if (patch.size() == longest_patch)
+        {
+            flush_patch();
+        }
+    }
+
+    flush_patch();
+    final_values.push_back(end);
+    return final_values;
+}
+
+/*
+* Cycles it takes to decode a delta coded strip.  A copied tile is a load and store like a literal, just from the
+* previous strip's buffer rather than the stream.
+*/
+template <typename Word>
+int delta_decode_cycles(const vector<Word>& encoded, const DecodeCosts& costs)
+{
+    const Word literal = (Word)((numeric_limits<Word>::max() >> 1) + 1);
+    const Word end = numeric_limits<Word>::max();
+
+    int cycles = costs.end;
+    size_t i = 0;
+    while (i < encoded.size() && encoded[i] != end)
+    {
+        if (encoded[i] < literal)
+        {
+            cycles += costs.header + encoded[i] * costs.literal;
+            i++;
+        }
+        else
+        {
+            cycles += costs.header + (encoded[i] - literal) * costs.literal;
+            i += 1 + encoded[i] - literal;
+        }
+    }
+
+    return cycles;
+}
+
+/*
+* Coding is Konami RLE squeezed for maps with no more than 16 codes, with run tiles in the header and literals packed
+* two to a byte
+*
+* $00-BF - Run of (n >> 4) + 3 of the tile in the low nibble
+* $C0-CF - Run of the tile in the low nibble as many times as the next byte
+* $D0-FE - The next n-$CF tiles are literals, two to a byte with the first in the high nibble
+* $FF - End of stream
+*
+* strip - the tile codes of a single row or column, in order, all below 16
+*/
+template <typename Word>
+vector<Word> nibble_encode(const vector<Word>& strip)
+{
+    const size_t longest_short_run = 14;
+    const size_t longest_run = 0xFF;
+    const size_t longest_literal = 0xFE - 0xCF;
+
+    vector<Word> final_values;
+    vector<Word> running_tiles;
+    auto flush_literals = [&]() {
+        if (running_tiles.empty())
+        {
+            return;
+        }
+
+        final_values.push_back((Word)(0xCF + running_tiles.size()));
+        for (size_t j = 0; j < running_tiles.size(); j += 2)
+        {
+            // An odd tile out gets a zero for company
+            final_values.push_back((Word)(running_tiles[j] << 4 | (j + 1 < running_tiles.size() ? running_tiles[j + 1] : 0)));
+        }
+
+        running_tiles.clear();
+    };
+
+    size_t i = 0;
+    while (i < strip.size())
+    {
+        Word tile = strip[i];
+        size_t count = 0;
+        while (i < strip.size() && strip[i] == tile)
+        {
+            count++;
+            i++;
+        }
+
+        // Same as Konami RLE, three repeats before a run pays for itself
+        if (count > 2)
+        {
+            flush_literals();
+            while (count)
+            {
+                if (count >= 3 && count <= longest_short_run)
+                {
+                    final_values.push_back((Word)((count - 3) << 4 | tile));
+                    count = 0;
+                }
+                else
+                {
+                    size_t length = min(count, longest_run);
+                    final_values.push_back((Word)(0xC0 | tile));
+                    final_values.push_back((Word)length);
+                    count -= length;
+                }
+            }
+        }
+        else
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                running_tiles.push_back(tile);
+                if (running_tiles.size() == longest_literal)
+                {
+                    flush_literals();
+                }
+            }
+        }
+    }
+
+    flush_literals();
+    final_values.push_back((Word)0xFF);
+    return final_values;
+}
+
+/*
+* Cycles it takes to decode a nibble packed strip
+*/
+template <typename Word>
+int nibble_decode_cycles(const vector<Word>& encoded, const DecodeCosts& costs)
+{
+    int cycles = costs.end;
+    size_t i = 0;
+    while (i < encoded.size() && encoded[i] != 0xFF)
+    {
+        if (encoded[i] < 0xC0)
+        {
+            cycles += costs.header + ((encoded[i] >> 4) + 3) * costs.run;
+            i++;
+        }
+        else if (encoded[i] < 0xD0)
+        {
+            cycles += costs.header + (i + 1 < encoded.size() ? encoded[i + 1] : 0) * costs.run;
+            i += 2;
+        }
+        else
+        {
+            int count = encoded[i] - 0xCF;
+            cycles += costs.header + count * costs.literal + (count + 1) / 2 * costs.unpack;
+            i += 1 + (count + 1) / 2;
+        }
+    }
+
+    return cycles;
+}
+
+/*
+* Everything parsed off the command line
+*/
+struct EncoderSettings
+{
+    string map_name;
+    string output_base;
+    int metatile_size = 16;
+    string file_of_mappings;
+    int depth = 0;
+    bool flips = false;
+    bool relative_palettes = false;
+    bool split = false;
+    int screen_width = 256;  // in pixels
+    int screen_height = 240; // in pixels
+    int code_width = 8;      // in bits
+    int levels = 1;          // tile size doubles with each level above the first
+    bool frequency_order = false;
+    int max_tiles = 0; // merge near duplicate tiles down to this many, 0 for no limit
+    bool quantize = false;
+    bool attributes = false;
+    vector<pair<string, string>> layers; // name and bitmap of each layer encoded alongside the map
+    vector<string> frames;               // bitmaps of an animated map's frames after the first, which is the map
+    bool combined_layer_codes = false;   // layers share the map's codes instead of each getting its own
+    vector<BGRA> quantize_palette; // empty to cluster the map's colors into four with k-means
+    vector<int> evaluate_sizes;
+    int offset_x = 0; // in pixels
+    int offset_y = 0; // in pixels
+    bool auto_offset = false;
+    bool find_offset = false;
+    DecodeCosts cycle_costs;
+    bool cycle_report = false;
+    bool optimize = false;
+    double cycle_weight = 0;
+    int cycle_budget = 0; // in cycles per strip, 0 for none
+    string codec = "konami";
+    bool chunk_screens = false;
+    string screen_orientation; // size or cycles to pick each screen's orientation by, empty for always rows
+    bool watch = false;
+    string cache_directory;
+    int cache_limit = 64; // in MB
+    string entropy; // tokens or tiles to Huffman code, empty for none
+    bool benchmark = false;
+};
+
+/*
+* Optimal encoding at the cycle weight we were given, leaning harder on cycles for any strip that's still over budget
+* until it fits or can't get any faster.  A heavier weight only ever replaces the encoding when it decodes in fewer
+* cycles.  Once a cycle is worth more than every byte the strip could possibly take, the encoder is already picking the
+* fewest cycles it can, so no heavier weight can do better.
+*/
+template <typename Word>
+vector<Word> encode_for_cycles(const vector<Word>& strip, const EncoderSettings& settings)
+{
+    // All literals plus a header per literal and the end marker is as big as a strip gets
+    double fastest_weight = (2.0 * strip.size() + 2) * sizeof(Word);
+
+    double weight = settings.cycle_weight;
+    vector<Word> encoded = rle_encode_optimal(strip, settings.cycle_costs, weight);
+    int cycles = decode_cycles(encoded, settings.cycle_costs);
+    while (settings.cycle_budget && cycles > settings.cycle_budget && weight <= fastest_weight)
+    {
+        weight = max(weight * 2, 1.0 / 16);
+        vector<Word> faster = rle_encode_optimal(strip, settings.cycle_costs, weight);
+        int faster_cycles = decode_cycles(faster, settings.cycle_costs);
+        if (faster_cycles < cycles)
+        {
+            encoded = move(faster);
+            cycles = faster_cycles;
+        }
+    }
+
+    return encoded;
+}
+
+/*
+* Words as little endian bytes, for the cache
+*/
+template <typename Word>
+vector<char> to_bytes(const vector<Word>& words)
+{
+    vector<char> bytes;
+    for (auto word : words)
+    {
+        for (size_t b = 0; b < sizeof(Word); b++)
+        {
+            bytes.push_back((char)(word >> (8 * b)));
+        }
+    }
+
+    return bytes;
+}
+
+template <typename Word>
+vector<Word> from_bytes(const vector<char>& bytes)
+{
+    vector<Word> words(bytes.size() / sizeof(Word));
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        for (size_t b = 0; b < sizeof(Word); b++)
+        {
+            words[i] |= (Word)((uint8_t)bytes[i * sizeof(Word) + b] << (8 * b));
+        }
+    }
+
+    return words;
+}
+
+/*
+* Encode a strip, going through the cache first if we have one.  previous is the strip before it for delta coding.
+*/
+template <typename Word>
+vector<Word> encode_strip(const vector<Word>& strip, const vector<Word>& previous, const EncoderSettings& settings, StripCache* cache)
+{
+    // 8 bit greedy entries keep the original codec name so existing caches stay valid
+    stringstream codec;
+    codec << settings.codec;
+    if (sizeof(Word) > 1)
+    {
+        codec << 8 * sizeof(Word);
+    }
+
+    if (settings.optimize)
+    {
+        const DecodeCosts& costs = settings.cycle_costs;
+        codec << "-optimal-" << costs.header << "," << costs.literal << "," << costs.run << "," << costs.end << "-" << setprecision(17) << settings.cycle_weight << "-" << settings.cycle_budget;
+    }
+
+    vector<char> key = to_bytes(strip);
+    bool delta = settings.codec == "delta";
+    if (delta)
+    {
+        // A delta depends on what it's against too; both are the same length so the key can't be ambiguous
+        vector<char> against = to_bytes(previous);
+        key.insert(key.begin(), against.begin(), against.end());
+    }
+
+    vector<char> cached;
+    if (cache && cache->lookup(codec.str(), key, cached))
+    {
+        return from_bytes<Word>(cached);
+    }
+
+    vector<Word> encoded;
+    if (delta)
+    {
+        encoded = delta_encode(strip, previous);
+    }
+    else if (settings.codec == "nibble")
+    {
+        encoded = nibble_encode(strip);
+    }
+    else
+    {
+        encoded = settings.optimize ? encode_for_cycles(strip, settings) : rle_encode(strip);
+    }
+
+    if (cache)
+    {
+        cache->store(codec.str(), key, to_bytes(encoded));
+    }
+
+    return encoded;
+}
+
+/*
+* A strip once encoded: its words as little endian bytes, the way they're written out, and what it costs to decode
+*/
+struct StripStats
+{
+    vector<char> encoded;
+    int cycles;
+};
+
+template <typename Word>
+string format_strip(const vector<Word>& strip, const vector<Word>& previous, const EncoderSettings& settings, StripCache* cache, StripStats* stats)
+{
+    vector<Word> encoded = encode_strip(strip, previous, settings, cache);
+    if (stats)
+    {
+        int cycles = settings.codec == "delta" ? delta_decode_cycles(encoded, settings.cycle_costs) :
+            settings.codec == "nibble" ? nibble_decode_cycles(encoded, settings.cycle_costs) : decode_cycles(encoded, settings.cycle_costs);
+        *stats = StripStats{ to_bytes(encoded), cycles };
+    }
+
+    return format_coding(encoded);
+}
+
+/*
+* Encode a strip of codes at the code width and format it for output.  previous is the strip before it, which only
+* delta coding looks at.
+*/
+string encode_line(const vector<TileCode>& strip, const vector<TileCode>& previous, const EncoderSettings& settings, StripCache* cache, StripStats* stats)
+{
+    // Nibble packed strips are bytes whatever the code width
+    if (settings.code_width == 16 && settings.codec != "nibble")
+    {
+        return format_strip(vector<uint16_t>(strip.begin(), strip.end()), vector<uint16_t>(previous.begin(), previous.end()), settings, cache, stats);
+    }
+
+    return format_strip(vector<uint8_t>(strip.begin(), strip.end()), vector<uint8_t>(previous.begin(), previous.end()), settings, cache, stats);
+}
+
+/*
+* Bytes a strip takes once encoded at the given code width
+*/
+size_t encoded_size(const vector<TileCode>& strip, int code_width)
+{
+    if (code_width == 16)
+    {
+        return rle_encode(vector<uint16_t>(strip.begin(), strip.end())).size() * 2;
+    }
+
+    return rle_encode(vector<uint8_t>(strip.begin(), strip.end())).size();
+}
+
+/*
+* A bitmap lined up with the map, like collision or objects, turned into its own grid of codes
+*/
+struct MapLayer
+{
+    string name;
+    TileFormat format;
+    vector<string> tiles;
+    map<string, TileCode> codes; // empty when the layer shares the map's codes
+    TileGrid grid;
+    TileCode dominant = 0; // the tile most of the layer is
+    vector<int> others;    // where every other tile is, upper left first
+};
+
+/*
+* Everything we keep resident between re-encodes in watch mode so that a change to one input doesn't force us to
+* redo the work for the others
+*/
+struct EncoderState
+{
+    shared_ptr<CBitmap> bitmap;
+    TileFormat source_format; // how tiles are read out of the map, before any canonicalization
+    TileFormat format;
+    vector<string> tiles;
+    map<string, TileCode> metatile_codes;
+    bool codes_from_mappings = false;
+    vector<map<string, TileCode>> region_codes; // when split, the codes each region adds to the base bank in metatile_codes
+    int offset_x = 0; // in pixels, where the tile grid starts
+    int offset_y = 0; // in pixels
+    int width = 0;    // in tiles
+    int height = 0;   // in tiles
+    TileGrid grid;
+    vector<string> horizontal_codings;
+    vector<string> vertical_codings;
+    vector<StripStats> horizontal_stats; // what each of the codings encoded to
+    vector<StripStats> vertical_stats;
+
+    // Extra per-tile data that rides along with the map, encoded the same way (e.g. "flips" -> flip bits per tile)
+    map<string, TileGrid> planes;
+    map<string, vector<string>> extra_outputs; // output suffix -> lines, for plane encodings and anything else written alongside
+    map<string, vector<char>> binary_outputs; // output suffix -> bytes, for anything that isn't meant to be read as hex
+    vector<MapLayer> layers;
+    vector<vector<string>> frame_tiles; // each frame after the first, read the same way as the map
+    vector<TileGrid> frames;            // and its codes, from the same dictionary as the map's
+};
+
+void print_usage(const cxxopts::Options& options)
+{
+    cout << options.help() << endl;
+}
+
+bool validate_args(const cxxopts::ParseResult& result, EncoderSettings& settings)
+{
+    settings.map_name = result["map"].as<string>();
+    if (settings.map_name.empty())
+    {
+        cout << "No map provided" << endl;
+        return false;
+    }
+
+    settings.output_base = result["output"].as<string>();
+    if (settings.output_base.empty())
+    {
+        cout << "Empty output provided" << endl;
+    }
+
+    settings.metatile_size = result["tileSize"].as<int>();
+    if (settings.metatile_size < 8)
+    {
+        cout << "Tile size must be at least 8 pixels" << endl;
+        return false;
+    }
+
+    settings.file_of_mappings = result["fileOfMappings"].as<string>();
+
+    settings.depth = result["depth"].as<int>();
+    if (settings.depth != 0 && settings.depth != 2 && settings.depth != 4)
+    {
+        cout << "Depth must be 2 or 4 bits per pixel" << endl;
+        return false;
+    }
+
+    settings.flips = result.count("flips") > 0;
+    settings.relative_palettes = result.count("relativePalettes") > 0;
+
+    settings.split = result.count("split") > 0;
+    if (settings.split && !settings.file_of_mappings.empty())
+    {
+        cout << "Can't split a map into regions when codes come from a mapping file" << endl;
+        return false;
+    }
+
+    settings.screen_orientation = result["screenOrientation"].as<string>();
+    if (!settings.screen_orientation.empty() && settings.screen_orientation != "size" && settings.screen_orientation != "cycles")
+    {
+        cout << "Screen orientation must be picked by size or cycles" << endl;
+        return false;
+    }
+
+    settings.chunk_screens = result.count("chunkScreens") > 0 || !settings.screen_orientation.empty();
+    if (settings.chunk_screens && settings.split)
+    {
+        cout << "A split map is already in regions of screens, it can't be chunked by screen too" << endl;
+        return false;
+    }
+
+    settings.screen_width = result["screenWidth"].as<int>();
+    settings.screen_height = result["screenHeight"].as<int>();
+    if (settings.screen_width < settings.metatile_size || settings.screen_height < settings.metatile_size)
+    {
+        cout << "Screens must be at least one tile in each direction" << endl;
+        return false;
+    }
+
+    settings.code_width = result["codeWidth"].as<int>();
+    if (settings.code_width != 8 && settings.code_width != 16)
+    {
+        cout << "Code width must be 8 or 16 bits" << endl;
+        return false;
+    }
+
+    string code_order = result["codeOrder"].as<string>();
+    if (code_order != "sorted" && code_order != "frequency")
+    {
+        cout << "Code order must be sorted or frequency" << endl;
+        return false;
+    }
+
+    settings.frequency_order = code_order == "frequency";
+
+    settings.max_tiles = result["maxTiles"].as<int>();
+    if (settings.max_tiles < 0)
+    {
+        cout << "Max tiles can't be negative" << endl;
+        return false;
+    }
+
+    if (settings.max_tiles && !settings.file_of_mappings.empty())
+    {
+        cout << "Tiles can't be merged when their codes come from a mapping file" << endl;
+        return false;
+    }
+
+    settings.levels = result["levels"].as<int>();
+    if (settings.levels < 1 || settings.levels > 4)
+    {
+        cout << "Levels must be between 1 and 4" << endl;
+        return false;
+    }
+
+    // Flips and palettes are per tile and a split map has no single grid, none of which the levels above can carry
+    if (settings.levels > 1 && (settings.flips || settings.relative_palettes || settings.split))
+    {
+        cout << "Levels can't be combined with flips, relative palettes or splitting" << endl;
+        return false;
+    }
+
+    if (result.count("layers"))
+    {
+        set<string> names = { "tiles" };
+        for (auto& layer : result["layers"].as<vector<string>>())
+        {
+            size_t equals = layer.find('=');
+            string name = layer.substr(0, equals);
+            if (equals == string::npos || name.empty() || equals + 1 == layer.size() ||
+                name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != string::npos || !names.insert(name).second)
+            {
+                cout << "Layers must be comma separated name=bitmap pairs, each with a different name made of letters, digits and underscores" << endl;
+                return false;
+            }
+
+            settings.layers.push_back(make_pair(name, layer.substr(equals + 1)));
+        }
+    }
+
+    string layer_codes = result["layerCodes"].as<string>();
+    if (layer_codes != "separate" && layer_codes != "combined")
+    {
+        cout << "Layer codes must be separate or combined" << endl;
+        return false;
+    }
+
+    settings.combined_layer_codes = layer_codes == "combined";
+    if (!settings.layers.empty() && (settings.levels > 1 || settings.split))
+    {
+        cout << "Layers can't be combined with levels or splitting" << endl;
+        return false;
+    }
+
+    // Shared codes means layer tiles have to be read the same way as the map's
+    if (!settings.layers.empty() && settings.combined_layer_codes && (settings.flips || settings.relative_palettes || settings.depth || !settings.file_of_mappings.empty()))
+    {
+        cout << "Combined layer codes can't be used with flips, relative palettes, a depth or a mapping file" << endl;
+        return false;
+    }
+
+    if (result.count("frames"))
+    {
+        settings.frames = result["frames"].as<vector<string>>();
+    }
+
+    // Frames share the map's one grid of tiles read straight out of the bitmap, which none of these leave as it is
+    if (!settings.frames.empty() && (settings.split || settings.levels > 1 || !settings.layers.empty() || settings.flips || settings.relative_palettes || settings.max_tiles))
+    {
+        cout << "Frames can't be combined with splitting, levels, layers, flips, relative palettes or max tiles" << endl;
+        return false;
+    }
+
+    string offset = result["offset"].as<string>();
+    if (offset == "auto")
+    {
+        settings.auto_offset = true;
+    }
+    else if (!offset.empty())
+    {
+        stringstream ss(offset);
+        char comma = 0;
+        ss >> settings.offset_x >> comma >> settings.offset_y;
+        if (ss.fail() || comma != ',' || settings.offset_x < 0 || settings.offset_y < 0 ||
+            settings.offset_x >= settings.metatile_size || settings.offset_y >= settings.metatile_size)
+        {
+            cout << "Offset must be auto or dx,dy within a tile" << endl;
+            return false;
+        }
+    }
+
+    settings.find_offset = result.count("findOffset") > 0;
+    settings.attributes = result.count("attributes") > 0;
+    if (settings.attributes && !settings.frames.empty())
+    {
+        cout << "Attributes are worked out from the map alone, so they can't be combined with frames" << endl;
+        return false;
+    }
+
+    string quantize = result["quantize"].as<string>();
+    settings.quantize = !quantize.empty();
+    if (settings.quantize && quantize != "auto")
+    {
+        stringstream ss(quantize);
+        string color;
+        while (getline(ss, color, ','))
+        {
+            if (color.size() != 6 || color.find_first_not_of("0123456789abcdefABCDEF") != string::npos)
+            {
+                settings.quantize_palette.clear();
+                break;
+            }
+
+            uint32_t value = (uint32_t)stoul(color, nullptr, 16);
+            settings.quantize_palette.push_back(BGRA{ (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), 0 });
+        }
+
+        if (settings.quantize_palette.empty() || settings.quantize_palette.size() > 256)
+        {
+            cout << "Quantize palette must be auto or up to 256 comma separated RRGGBB colors" << endl;
+            return false;
+        }
+    }
+
+    vector<int> costs = result["cycleCosts"].as<vector<int>>();
+    if (costs.size() < 4 || costs.size() > 5 || *min_element(costs.begin(), costs.end()) < 0)
+    {
+        cout << "Cycle costs must be four or five counts: header, literal, run, end and optionally nibble unpacking" << endl;
+        return false;
+    }
+
+    settings.cycle_costs = DecodeCosts{ costs[0], costs[1], costs[2], costs[3] };
+    if (costs.size() == 5)
+    {
+        settings.cycle_costs.unpack = costs[4];
+    }
+
+    settings.cycle_report = result.count("cycleReport") > 0;
+    settings.cycle_weight = result["cycleWeight"].as<double>();
+    settings.cycle_budget = result["cycleBudget"].as<int>();
+    if (settings.cycle_weight < 0 || settings.cycle_budget < 0)
+    {
+        cout << "Cycle weight and budget can't be negative" << endl;
+        return false;
+    }
+
+    // A weight or budget only means anything to the optimal encoder
+    settings.optimize = result.count("optimize") > 0 || settings.cycle_weight > 0 || settings.cycle_budget > 0;
+
+    settings.codec = result["codec"].as<string>();
+    if (settings.codec != "konami" && settings.codec != "delta" && settings.codec != "nibble")
+    {
+        cout << "Codec must be konami, delta or nibble" << endl;
+        return false;
+    }
+
+    if (settings.codec == "nibble" && settings.optimize)
+    {
+        cout << "Only Konami RLE can be optimized for cycles" << endl;
+        return false;
+    }
+
+    if (settings.codec == "delta" && (settings.optimize || settings.chunk_screens))
+    {
+        cout << "Delta coding can't be optimized for cycles or used on screens, which have no strip before them" << endl;
+        return false;
+    }
+
+    if (result.count("evaluateSizes"))
+    {
+        settings.evaluate_sizes = result["evaluateSizes"].as<vector<int>>();
+        sort(settings.evaluate_sizes.begin(), settings.evaluate_sizes.end());
+        settings.evaluate_sizes.erase(unique(settings.evaluate_sizes.begin(), settings.evaluate_sizes.end()), settings.evaluate_sizes.end());
+        for (int size : settings.evaluate_sizes)
+        {
+            if (size < 8 || size % settings.evaluate_sizes[0])
+            {
+                cout << "Sizes to evaluate must be at least 8 pixels and multiples of the smallest size" << endl;
+                return false;
+            }
+        }
+
+        if (settings.flips || settings.relative_palettes)
+        {
+            cout << "Evaluating sizes only looks at plain tiles, not flips or relative palettes" << endl;
+            return false;
+        }
+    }
+
+    settings.entropy = result["entropy"].as<string>();
+    if (!settings.entropy.empty() && settings.entropy != "tokens" && settings.entropy != "tiles")
+    {
+        cout << "Entropy coding works on tokens or tiles" << endl;
+        return false;
+    }
+
+    settings.benchmark = result.count("benchmark") > 0;
+    if (settings.benchmark && settings.entropy.empty())
+    {
+        cout << "Benchmarking needs an entropy stage to time" << endl;
+        return false;
+    }
+
+    // stdin can only be read once, and a stream has nothing to watch or to update in place
+    int from_stdin = settings.map_name == "-";
+    for (auto& layer : settings.layers)
+    {
+        from_stdin += layer.second == "-";
+    }
+
+    from_stdin += (int)count(settings.frames.begin(), settings.frames.end(), "-");
+    if (from_stdin > 1)
+    {
+        cout << "Only one bitmap can be read from stdin" << endl;
+        return false;
+    }
+
+    settings.watch = result.count("watch") > 0;
+    if (settings.watch && (from_stdin || settings.output_base == "-"))
+    {
+        cout << "Watch mode needs files to watch and write, not stdin or stdout" << endl;
+        return false;
+    }
+
+    settings.cache_directory = result["cache"].as<string>();
+    settings.cache_limit = result["cacheLimit"].as<int>();
+    if (settings.cache_limit < 1)
+    {
+        cout << "Cache limit must be at least 1 MB" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+* Read the bitmap names out of a mapping file so watch mode knows what else to keep an eye on
+*/
+vector<string> read_mapping_bitmaps(const string& mapping_file)
+{
+    vector<string> bitmaps;
+    fstream file(mapping_file, ios::in);
+    string line;
+    while (getline(file, line))
+    {
+        bitmaps.push_back(line.substr(0, line.find(',')));
+    }
+
+    return bitmaps;
+}
+
+bool populate_metatile_codes(const string& mapping_file, const EncoderSettings& settings, const TileFormat& source_format, const TileFormat& format, map<string, TileCode>& metatile_codes)
+{
+    int metatile_size = settings.metatile_size;
+    fstream file(mapping_file, ios::in);
+    if (!file.is_open() || !file.good())
+    {
+        cout << "Couldn't open " << mapping_file << endl;
+        return false;
+    }
+
+    int upper_left = (metatile_size - 1) * metatile_size;
+    string line;
+    while (getline(file, line))
+    {
+        auto pos = line.find(',');
+        string bitmap_filename = line.substr(0, pos);
+        int code = stoi(line.substr(pos + 1));
+        if (code < 0 || code >= 1 << settings.code_width)
+        {
+            cout << "Code " << code << " for " << bitmap_filename << " doesn't fit in " << settings.code_width << " bits" << endl;
+            return false;
+        }
+
+        CBitmap bitmap;
+        if (!bitmap.Load((bitmap_filename.c_str())))
+        {
+            cout << "Bitmap " << bitmap_filename << " not found" << endl;
+            return false;
+        }
+
+        if (bitmap.GetWidth() != metatile_size || bitmap.GetHeight() != metatile_size)
+        {
+            cout << "Bitmap " << bitmap_filename << " must be the tile size" << endl;
+            return false;
+        }
+
+        RGBA* bits = (RGBA*)bitmap.GetBits();
+        string tile_string;
+        if (!source_format.indexed)
+        {
+            tile_string = make_tile_string(bits + upper_left, metatile_size, metatile_size);
+        }
+        else if (!make_palette_tile_string(bits + upper_left, metatile_size, metatile_size, source_format, tile_string))
+        {
+            cout << "Bitmap " << bitmap_filename << " uses a color that isn't in the map's palette" << endl;
+            return false;
+        }
+        else if (source_format.depth)
+        {
+            if (!check_tile_depth(tile_string, source_format.depth, "Bitmap " + bitmap_filename))
+            {
+                return false;
+            }
+
+            tile_string = pack_tile_string(tile_string, source_format.depth);
+        }
+
+        if (settings.relative_palettes)
+        {
+            RelativeTile relative;
+            if (!make_relative_tile(tile_string, source_format, format, metatile_size, settings.flips, "Bitmap " + bitmap_filename, relative))
+            {
+                return false;
+            }
+
+            tile_string = relative.tile;
+        }
+        else if (settings.flips)
+        {
+            tile_string = canonical_flip(tile_string, format, metatile_size).first;
+        }
+
+        metatile_codes[tile_string] = (TileCode)code;
+    }
+
+    return true;
+}
+
+/*
+* Load the map; with tiles_to_fit it also has to divide evenly into tiles of that size
+*/
+bool load_map(const string& map_name, int tiles_to_fit, shared_ptr<CBitmap>& bitmap)
+{
+    // Load into a fresh bitmap so a failed reload in watch mode leaves the last good one in place
+    shared_ptr<CBitmap> loaded(new CBitmap());
+    // Indexed maps stay as palette indices rather than being expanded to RGBA
+    if (map_name == "-")
+    {
+        // The loader seeks around the file, which a pipe can't do, so take in all of stdin first
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        stringstream input;
+        input << cin.rdbuf();
+        if (!loaded->Load(input, true))
+        {
+            cout << "No bitmap on stdin" << endl;
+            return false;
+        }
+    }
+    else if (!loaded->Load(map_name.c_str(), true))
+    {
+        cout << "Bitmap " << map_name << " not found" << endl;
+        return false;
+    }
+
+    if (tiles_to_fit && (loaded->GetHeight() % tiles_to_fit || loaded->GetWidth() % tiles_to_fit))
+    {
+        cout << "Bitmap " << map_name << " dimensions must be evenly divisible by the tile size" << endl;
+        return false;
+    }
+
+    bitmap = move(loaded);
+    return true;
+}
+
+/*
+* Stringify every tile in the map in a single pass, upper left first.  Given area_colors, the same pass also collects the
+* colors each attribute area of the tile grid uses, upper left first.
+*/
+bool identify_tiles(CBitmap& bitmap, const TileFormat& format, int metatile_size, int offset_x, int offset_y, vector<string>& tiles, vector<set<uint32_t>>* area_colors = nullptr)
+{
+    // Bitmaps index from the lower left, but we want to output index from the upper left
+    int upper_left = (bitmap.GetHeight() - 1 - offset_y) * bitmap.GetWidth() + offset_x;
+    int rows = (bitmap.GetHeight() - offset_y) / metatile_size;
+    int columns = (bitmap.GetWidth() - offset_x) / metatile_size;
+    int areas_across = (columns * metatile_size + attribute_size - 1) / attribute_size;
+    if (area_colors)
+    {
+        area_colors->assign(areas_across * ((rows * metatile_size + attribute_size - 1) / attribute_size), set<uint32_t>());
+    }
+
+    tiles.clear();
+    for (int row = 0; row < rows; row++)
+    {
+        for (int column = 0; column < columns; column++)
+        {
+            string tile_string;
+            if (!make_map_tile_string(bitmap, format, upper_left - row * metatile_size * bitmap.GetWidth() + column * metatile_size, metatile_size, tile_string))
+            {
+                return false;
+            }
+
+            if (area_colors)
+            {
+                vector<uint32_t> pixels = tile_pixels(tile_string, format, metatile_size);
+                for (int y = 0; y < metatile_size; y++)
+                {
+                    int area_row = (row * metatile_size + y) / attribute_size * areas_across;
+                    for (int x = 0; x < metatile_size; x++)
+                    {
+                        (*area_colors)[area_row + (column * metatile_size + x) / attribute_size].insert(pixels[y * metatile_size + x]);
+                    }
+                }
+            }
+
+            tiles.push_back(tile_string);
+        }
+    }
+
+    return true;
+}
+
+/*
+* Work out NES attributes from the colors each attribute area uses.  The color in the most areas is the backdrop every
+* palette shares, and each area's other colors are packed into as few palettes of 3 more colors as we can manage,
+* biggest sets first into whichever palette grows the least.  attributes gets one byte per 2x2 areas, upper left area
+* in the low bits then upper right, lower left and lower right, and each palette comes out as a line of the backdrop
+* and its colors in the map's source format: palette indices for indexed maps, red/green/blue bytes otherwise.
+*/
+bool build_attributes(const vector<set<uint32_t>>& area_colors, int areas_across, const TileFormat& format, TileGrid& attributes, vector<string>& palette_lines)
+{
+    const size_t palette_count = 4;
+
+    map<uint32_t, size_t> areas_using;
+    for (auto& colors : area_colors)
+    {
+        for (uint32_t color : colors)
+        {
+            areas_using[color]++;
+        }
+    }
+
+    uint32_t backdrop = 0;
+    size_t most_areas = 0;
+    for (auto& entry : areas_using)
+    {
+        if (entry.second > most_areas)
+        {
+            backdrop = entry.first;
+            most_areas = entry.second;
+        }
+    }
+
+    vector<set<uint32_t>> area_sets;
+    vector<size_t> order;
+    for (size_t area = 0; area < area_colors.size(); area++)
+    {
+        set<uint32_t> colors = area_colors[area];
+        colors.erase(backdrop);
+        if (colors.size() > attribute_colors - 1)
+        {
+            cout << "Attribute area at (" << area % areas_across << ", " << area / areas_across << ") uses " << colors.size() << " colors besides the backdrop, more than " << attribute_colors - 1 << endl;
+            return false;
+        }
+
+        area_sets.push_back(colors);
+        order.push_back(area);
+    }
+
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return area_sets[a].size() > area_sets[b].size(); });
+
+    vector<set<uint32_t>> palettes;
+    vector<uint8_t> assignments(area_sets.size());
+    for (size_t area : order)
+    {
+        size_t best = palettes.size();
+        size_t best_growth = attribute_colors;
+        for (size_t p = 0; p < palettes.size(); p++)
+        {
+            set<uint32_t> merged = palettes[p];
+            merged.insert(area_sets[area].begin(), area_sets[area].end());
+            if (merged.size() <= attribute_colors - 1 && merged.size() - palettes[p].size() < best_growth)
+            {
+                best = p;
+                best_growth = merged.size() - palettes[p].size();
+            }
+        }
+
+        if (best == palettes.size())
+        {
+            if (palettes.size() == palette_count)
+            {
+                cout << "Attribute areas need more than " << palette_count << " palettes, the first that doesn't fit is at (" << area % areas_across << ", " << area / areas_across << ")" << endl;
+                return false;
+            }
+
+            palettes.push_back(set<uint32_t>());
+        }
+
+        palettes[best].insert(area_sets[area].begin(), area_sets[area].end());
+        assignments[area] = (uint8_t)best;
+    }
+
+    int areas_down = areas_across ? (int)area_sets.size() / areas_across : 0;
+    attributes = TileGrid{ (areas_across + 1) / 2, (areas_down + 1) / 2, vector<TileCode>() };
+    for (int y = 0; y < attributes.height; y++)
+    {
+        for (int x = 0; x < attributes.width; x++)
+        {
+            TileCode attribute = 0;
+            for (int quadrant = 0; quadrant < 4; quadrant++)
+            {
+                int area_x = x * 2 + (quadrant & 1);
+                int area_y = y * 2 + (quadrant >> 1);
+                if (area_x < areas_across && area_y < areas_down)
+                {
+                    attribute |= assignments[area_y * areas_across + area_x] << (quadrant * 2);
+                }
+            }
+
+            attributes.codes.push_back(attribute);
+        }
+    }
+
+    // Palettes that aren't full are padded out with the backdrop
+    palette_lines.clear();
+    for (auto& palette : palettes)
+    {
+        vector<uint32_t> colors(1, backdrop);
+        colors.insert(colors.end(), palette.begin(), palette.end());
+        colors.resize(attribute_colors, backdrop);
+
+        vector<uint8_t> bytes;
+        for (uint32_t color : colors)
+        {
+            if (format.indexed)
+            {
+                bytes.push_back((uint8_t)color);
+            }
+            else
+            {
+                bytes.insert(bytes.end(), { (uint8_t)(color >> 16), (uint8_t)(color >> 8), (uint8_t)color });
+            }
+        }
+
+        palette_lines.push_back(format_coding(bytes));
+    }
+
+    return true;
+}
+
+/*
+* A tile of palette indices as the red, green and blue bytes of each pixel, the same string the tile would have been
+* if the map were truecolor
+*/
+string expand_tile_string(const string& tile, const TileFormat& format)
+{
+    string indices = format.depth ? unpack_tile_string(tile, format.depth, (int)tile.size() * 8 / format.depth) : tile;
+    string expanded;
+    for (char index : indices)
+    {
+        uint8_t i = (uint8_t)index;
+        BGRA color = i < format.palette.size() ? format.palette[i] : BGRA{ 0, 0, 0, 0 };
+        expanded.push_back((char)color.Red);
+        expanded.push_back((char)color.Green);
+        expanded.push_back((char)color.Blue);
+    }
+
+    return expanded;
+}
+
+/*
+* The map's distinct tiles in the order codes get handed out: the arbitrary (sorted) order of the tile strings, or
+* most used first with ties left in sorted order.  Counting uses comes straight off the tiles we already identified.
+* Indexed tiles are sorted by their colors rather than their indices, so a map gets the same codes whether it's saved
+* palettized or truecolor.
+*/
+vector<string> order_tiles(const vector<string>& tiles, bool by_frequency, const TileFormat& format)
+{
+    map<string, size_t> counts;
+    for (auto& tile : tiles)
+    {
+        counts[tile]++;
+    }
+
+    // Sort key, tile, uses
+    vector<tuple<string, string, size_t>> ordered;
+    bool expand = format.indexed && !format.relative;
+    for (auto& entry : counts)
+    {
+        ordered.push_back(make_tuple(expand ? expand_tile_string(entry.first, format) : string(), entry.first, entry.second));
+    }
+
+    sort(ordered.begin(), ordered.end());
+    if (by_frequency)
+    {
+        stable_sort(ordered.begin(), ordered.end(), [](const tuple<string, string, size_t>& a, const tuple<string, string, size_t>& b) { return get<2>(a) > get<2>(b); });
+    }
+
+    vector<string> metatiles;
+    for (auto& entry : ordered)
+    {
+        metatiles.push_back(get<1>(entry));
+    }
+
+    return metatiles;
+}
+
+/*
+* Figure out what our metatiles are from the map itself; codes come out in the order of order_tiles
+*/
+bool generate_metatile_codes(const vector<string>& tiles, int code_width, bool by_frequency, const TileFormat& format, map<string, TileCode>& metatile_codes)
+{
+    // TODO: give caller the option to pass in a file that maps metatile bitmaps to their code and use that to
+    // generate the metatile_codes map; would let us skip this for loop and the next one and give us control
+    // over how things are encoded; especially important for attribute tables but also nice if you want your
+    // metatiles to have some order to them, rather than the arbitrary order we get by generating it from the map.
+    // But still leave in this method because it could be useful (hell, even if it's to do a first pass and create the
+    // metatiles before then giving them your own codes and re-encoding the map)
+    vector<string> metatiles = order_tiles(tiles, by_frequency, format);
+
+    if (metatiles.size() > (size_t)1 << code_width)
+    {
+        cout << "Too many metatiles generated at provided tile size: " << metatiles.size() << " (--split can break the map into regions";
+        cout << (code_width < 16 ? " or --codeWidth 16 can give more codes)" : ")") << endl;
+        return false;
+    }
+
+    metatile_codes.clear();
+    TileCode code = 0;
+    for (auto metatile : metatiles)
+    {
+        metatile_codes[metatile] = code;
+        code++;
+    }
+
+    return true;
+}
+
+/*
+* Turn the identified tiles into codes so the strips can be encoded from codes rather than pixels
+*/
+bool build_tile_grid(const vector<string>& tiles, int width, int height, const map<string, TileCode>& metatile_codes, TileGrid& grid)
+{
+    grid.width = width;
+    grid.height = height;
+    grid.codes.clear();
+    for (auto& tile : tiles)
+    {
+        auto code = metatile_codes.find(tile);
+        if (code == metatile_codes.end())
+        {
+            cout << "Tile at (" << grid.codes.size() % width << ", " << grid.codes.size() / width << ") has no code in the mappings" << endl;
+            return false;
+        }
+
+        grid.codes.push_back(code->second);
+    }
+
+    return true;
+}
+
+/*
+* Encode both orientations of a grid, with what each strip costs if asked
+*/
+void encode_map(const TileGrid& grid, const EncoderSettings& settings, StripCache* cache, vector<string>& horizontal_codings, vector<string>& vertical_codings,
+    vector<StripStats>* horizontal_stats = nullptr, vector<StripStats>* vertical_stats = nullptr)
+{
+    horizontal_codings.clear();
+    if (horizontal_stats)
+    {
+        horizontal_stats->assign(grid.height, StripStats());
+    }
+
+    // Encode horizontal strips
+    vector<TileCode> previous(grid.width, 0);
+    for (int y = 0; y < grid.height; y++)
+    {
+        vector<TileCode> row = grid.row(y);
+        horizontal_codings.push_back(encode_line(row, previous, settings, cache, horizontal_stats ? &(*horizontal_stats)[y] : nullptr));
+        previous = move(row);
+    }
+
+    vertical_codings.clear();
+    if (vertical_stats)
+    {
+        vertical_stats->assign(grid.width, StripStats());
+    }
+
+    // Encode vertical strips
+    previous.assign(grid.height, 0);
+    for (int x = 0; x < grid.width; x++)
+    {
+        vector<TileCode> column = grid.column(x);
+        vertical_codings.push_back(encode_line(column, previous, settings, cache, vertical_stats ? &(*vertical_stats)[x] : nullptr));
+        previous = move(column);
+    }
+}
+
+/*
+* A line of the byte offset each strip starts at, for finding a strip without decoding the ones before it
+*/
+string strip_index(const vector<StripStats>& stats)
+{
+    vector<uint16_t> starts;
+    size_t total = 0;
+    for (auto& strip : stats)
+    {
+        if (total > 0xFFFF)
+        {
+            cout << "Strips are more than 64KB, too big for the 16 bit offsets in the strip index" << endl;
+        }
+
+        starts.push_back((uint16_t)total);
+        total += strip.encoded.size();
+    }
+
+    return format_coding(starts);
+}
+
+/*
+* A line per strip of its bytes and decode cycles, flagging the ones over budget, with the worst of each orientation
+* printed as well
+*/
+vector<string> cycle_report(const EncoderSettings& settings, const vector<StripStats>& horizontal_stats, const vector<StripStats>& vertical_stats)
+{
+    vector<string> lines = { "codec: " + settings.codec };
+    int over_budget = 0;
+    for (auto orientation : { make_pair("row", &horizontal_stats), make_pair("column", &vertical_stats) })
+    {
+        int worst = 0;
+        for (size_t i = 0; i < orientation.second->size(); i++)
+        {
+            const StripStats& stats = (*orientation.second)[i];
+            stringstream ss;
+            ss << orientation.first << " " << i << ": " << stats.encoded.size() << " bytes, " << stats.cycles << " cycles";
+            if (settings.cycle_budget && stats.cycles > settings.cycle_budget)
+            {
+                ss << " (over budget)";
+                over_budget++;
+            }
+
+            lines.push_back(ss.str());
+            worst = max(worst, stats.cycles);
+        }
+
+        cout << "Worst " << orientation.first << " decodes in " << worst << " cycles" << endl;
+    }
+
+    if (settings.cycle_budget)
+    {
+        cout << over_budget << " strip(s) over the budget of " << settings.cycle_budget << " cycles" << endl;
+    }
+
+    return lines;
+}
+
+/*
+* Encode every screen of the grid on its own, as one stream of its rows with its own terminator, so a screen can be
+* decoded without touching the rest of the map.  Screens along the right and bottom are cut short if the map doesn't
+* divide evenly into them.  Identical screens are found by hash and only encoded once, with the unique ones encoded in
+* parallel.  screens gets a line per unique screen and index a line per row of screens of the byte offset each
+* screen's data starts at, counting from the start of the first unique screen.
+*
+* With a screen orientation to pick by, each screen is also encoded as one stream of its columns and keeps whichever
+* is smaller or decodes in fewer cycles, the other measure breaking ties.  orientations then gets a line per row of
+* screens of 0 for a screen stored by rows or 1 for one stored by columns.
+*/
+void encode_screens(const TileGrid& grid, const EncoderSettings& settings, StripCache* cache, vector<string>& screens, vector<string>& index, vector<string>& orientations)
+{
+    int tile_size = settings.metatile_size << (settings.levels - 1);
+    int screen_columns = max(1, settings.screen_width / tile_size);
+    int screen_rows = max(1, settings.screen_height / tile_size);
+    int across = (grid.width + screen_columns - 1) / screen_columns;
+    int down = (grid.height + screen_rows - 1) / screen_rows;
+
+    vector<TileGrid> unique_screens;
+    unordered_map<size_t, vector<size_t>> by_hash;
+    vector<size_t> screen_ids;
+    for (int sy = 0; sy < down; sy++)
+    {
+        for (int sx = 0; sx < across; sx++)
+        {
+            TileGrid screen;
+            screen.width = min(grid.width, (sx + 1) * screen_columns) - sx * screen_columns;
+            screen.height = min(grid.height, (sy + 1) * screen_rows) - sy * screen_rows;
+            for (int y = sy * screen_rows; y < sy * screen_rows + screen.height; y++)
+            {
+                for (int x = sx * screen_columns; x < sx * screen_columns + screen.width; x++)
+                {
+                    screen.codes.push_back(grid.codes[y * grid.width + x]);
+                }
+            }
+
+            // Hashes only narrow it down, a screen still has to match code for code to share
+            auto& candidates = by_hash[hash<string>()(string((const char*)screen.codes.data(), screen.codes.size() * sizeof(TileCode)))];
+            auto match = find_if(candidates.begin(), candidates.end(), [&](size_t id) {
+                return unique_screens[id].width == screen.width && unique_screens[id].codes == screen.codes;
+            });
+            if (match != candidates.end())
+            {
+                screen_ids.push_back(*match);
+                continue;
+            }
+
+            candidates.push_back(unique_screens.size());
+            screen_ids.push_back(unique_screens.size());
+            unique_screens.push_back(move(screen));
+        }
+    }
+
+    screens.assign(unique_screens.size(), string());
+    vector<StripStats> stats(unique_screens.size());
+    vector<uint8_t> by_columns(unique_screens.size(), 0);
+    parallel_for(unique_screens.size(), [&](size_t i) {
+        const TileGrid& screen = unique_screens[i];
+        screens[i] = encode_line(screen.codes, {}, settings, cache, &stats[i]);
+        if (settings.screen_orientation.empty())
+        {
+            return;
+        }
+
+        vector<TileCode> columns;
+        for (int x = 0; x < screen.width; x++)
+        {
+            vector<TileCode> column = screen.column(x);
+            columns.insert(columns.end(), column.begin(), column.end());
+        }
+
+        StripStats column_stats;
+        string column_line = encode_line(columns, {}, settings, cache, &column_stats);
+        auto by_size = [](const StripStats& stats) { return make_pair(stats.encoded.size(), stats.cycles); };
+        auto by_cycles = [](const StripStats& stats) { return make_pair((size_t)stats.cycles, stats.encoded.size()); };
+        bool smaller = settings.screen_orientation == "size" ? by_size(column_stats) < by_size(stats[i]) : by_cycles(column_stats) < by_cycles(stats[i]);
+        if (smaller)
+        {
+            screens[i] = column_line;
+            stats[i] = column_stats;
+            by_columns[i] = 1;
+        }
+    });
+
+    vector<size_t> starts;
+    size_t total = 0;
+    for (auto& screen : stats)
+    {
+        starts.push_back(total);
+        total += screen.encoded.size();
+    }
+
+    if (!starts.empty() && starts.back() > 0xFFFF)
+    {
+        cout << "Screen data is " << total << " bytes, too big for the 16 bit offsets in the screen index" << endl;
+    }
+
+    index.clear();
+    orientations.clear();
+    for (int sy = 0; sy < down; sy++)
+    {
+        vector<uint16_t> row;
+        vector<uint8_t> row_orientations;
+        for (int sx = 0; sx < across; sx++)
+        {
+            row.push_back((uint16_t)starts[screen_ids[sy * across + sx]]);
+            row_orientations.push_back(by_columns[screen_ids[sy * across + sx]]);
+        }
+
+        index.push_back(format_coding(row));
+        if (!settings.screen_orientation.empty())
+        {
+            orientations.push_back(format_coding(row_orientations));
+        }
+    }
+
+    cout << "Encoded " << screen_ids.size() << " screens, " << unique_screens.size() << " unique";
+    if (!settings.screen_orientation.empty())
+    {
+        cout << ", " << count(by_columns.begin(), by_columns.end(), 1) << " of them by columns";
+    }
+
+    cout << endl;
+}
+
+/*
+* The settings to encode a grid with.  Nibble packing needs every code in the grid to fit in 4 bits, so a grid with
+* bigger codes falls back to Konami RLE.
+*/
+EncoderSettings grid_settings(const TileGrid& grid, const EncoderSettings& settings)
+{
+    EncoderSettings adjusted = settings;
+    if (settings.codec == "nibble" && any_of(grid.codes.begin(), grid.codes.end(), [](TileCode code) { return code > 0xF; }))
+    {
+        adjusted.codec = "konami";
+    }
+
+    return adjusted;
+}
+
+/*
+* The strips of one orientation for the entropy coder: the codec's output, as words of word_bytes, with tokens, or the
+* grid's own codes with tiles
+*/
+vector<vector<uint16_t>> entropy_strips(const TileGrid& grid, const vector<StripStats>& stats, int word_bytes, bool horizontal, const string& source)
+{
+    vector<vector<uint16_t>> strips;
+    if (source == "tokens")
+    {
+        for (auto& strip : stats)
+        {
+            if (word_bytes == 2)
+            {
+                strips.push_back(from_bytes<uint16_t>(strip.encoded));
+            }
+            else
+            {
+                vector<uint8_t> words = from_bytes<uint8_t>(strip.encoded);
+                strips.push_back(vector<uint16_t>(words.begin(), words.end()));
+            }
+        }
+
+        return strips;
+    }
+
+    int count = horizontal ? grid.height : grid.width;
+    for (int i = 0; i < count; i++)
+    {
+        strips.push_back(horizontal ? grid.row(i) : grid.column(i));
+    }
+
+    return strips;
+}
+
+void append_bytes(vector<char>& output, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        output.push_back((char)(value >> (8 * i)));
+    }
+}
+
+/*
+* Huffman code strips with a table built just for them.  Laid out little endian as: what's coded (0 for codec tokens, 1
+* for tile codes), the number of symbols in the table, a symbol (2 bytes) and code length (1 byte) for each in canonical
+* order, the number of strips, the bit offset (4 bytes) and symbol count (2 bytes) of each strip, the number of bytes of
+* coded data (4 bytes), then the data itself, most significant bit first.
+*/
+vector<char> entropy_code(const vector<vector<uint16_t>>& strips, const string& source)
+{
+    vector<uint16_t> symbols;
+    for (auto& strip : strips)
+    {
+        symbols.insert(symbols.end(), strip.begin(), strip.end());
+    }
+
+    HuffmanCode code(symbols);
+    vector<uint8_t> bits;
+    uint64_t bit_count = 0;
+    vector<char> output;
+    append_bytes(output, source == "tokens" ? 0 : 1, 1);
+    append_bytes(output, code.lengths().size(), 2);
+    for (auto& entry : code.lengths())
+    {
+        append_bytes(output, entry.first, 2);
+        append_bytes(output, entry.second, 1);
+    }
+
+    append_bytes(output, strips.size(), 2);
+    for (auto& strip : strips)
+    {
+        append_bytes(output, bit_count, 4);
+        append_bytes(output, strip.size(), 2);
+        code.encode(strip, bits, bit_count);
+    }
+
+    append_bytes(output, bits.size(), 4);
+    output.insert(output.end(), bits.begin(), bits.end());
+    return output;
+}
+
+/*
+* Time Huffman coding and table-driven decoding of strips, repeating each until there's enough time on the clock to
+* measure, and report throughput in MB of symbols at the output width.  Building the table is timed on its own since it
+* doesn't grow with the map.  Decoding works from the code lengths alone, the same as a decoder reading them out of the
+* file would.
+*/
+void benchmark_entropy(const string& name, const vector<vector<uint16_t>>& strips, int word_bytes)
+{
+    typedef chrono::steady_clock Clock;
+    const double minimum_seconds = 0.25;
+
+    vector<uint16_t> symbols;
+    for (auto& strip : strips)
+    {
+        symbols.insert(symbols.end(), strip.begin(), strip.end());
+    }
+
+    int builds = 0;
+    auto start = Clock::now();
+    double build_seconds = 0;
+    do
+    {
+        HuffmanCode code(symbols);
+        builds++;
+        build_seconds = chrono::duration<double>(Clock::now() - start).count();
+    } while (build_seconds < minimum_seconds);
+
+    HuffmanCode code(symbols);
+    vector<uint8_t> bits;
+    uint64_t bit_count = 0;
+    vector<uint64_t> offsets;
+    int encodes = 0;
+    start = Clock::now();
+    double encode_seconds = 0;
+    do
+    {
+        bits.clear();
+        bit_count = 0;
+        offsets.clear();
+        for (auto& strip : strips)
+        {
+            offsets.push_back(bit_count);
+            code.encode(strip, bits, bit_count);
+        }
+
+        encodes++;
+        encode_seconds = chrono::duration<double>(Clock::now() - start).count();
+    } while (encode_seconds < minimum_seconds);
+
+    HuffmanCode decoder(code.lengths());
+    vector<uint16_t> decoded;
+    decoded.reserve(symbols.size());
+    bool round_trip = true;
+    int decodes = 0;
+    start = Clock::now();
+    double decode_seconds = 0;
+    do
+    {
+        decoded.clear();
+        for (size_t s = 0; s < strips.size(); s++)
+        {
+            round_trip = decoder.decode(bits, bit_count, offsets[s], strips[s].size(), decoded) && round_trip;
+        }
+
+        decodes++;
+        decode_seconds = chrono::duration<double>(Clock::now() - start).count();
+    } while (decode_seconds < minimum_seconds);
+
+    double megabytes = (double)symbols.size() * word_bytes / 1e6;
+    cout << fixed << setprecision(1) << "Huffman " << name << ": table " << build_seconds * 1e6 / builds << " us, encode "
+        << megabytes * encodes / encode_seconds << " MB/s, decode " << megabytes * decodes / decode_seconds << " MB/s" << defaultfloat << endl;
+    if (!round_trip || decoded != symbols)
+    {
+        cout << "Huffman " << name << " strips didn't decode back to what was coded" << endl;
+    }
+}
+
+/*
+* Code a layer as its dominant tile plus the tiles that aren't it, in whichever of two layouts is smaller.  Codes are at
+* the code width and everything is little endian:
+*   list: $00, the dominant code, the number of other tiles (2 bytes), then each one's position (2 bytes, y * width + x)
+*         and code
+*   mask: $01, the dominant code, a bit per tile upper left first and high bit first, set where it isn't the dominant
+*         tile, then the code of each set bit in order
+* Only the other tiles get looked at, so this takes time in proportion to how many there are.
+*/
+vector<char> sparse_encode(const MapLayer& layer, int code_width)
+{
+    int code_bytes = code_width / 8;
+    size_t tiles = layer.grid.codes.size();
+    size_t mask_size = 1 + code_bytes + (tiles + 7) / 8 + layer.others.size() * code_bytes;
+    size_t list_size = 1 + code_bytes + 2 + layer.others.size() * (2 + code_bytes);
+    bool list = tiles <= 0x10000 && layer.others.size() <= 0xFFFF && list_size <= mask_size;
+
+    vector<char> output;
+    append_bytes(output, list ? 0 : 1, 1);
+    append_bytes(output, layer.dominant, code_bytes);
+    if (list)
+    {
+        append_bytes(output, layer.others.size(), 2);
+        for (int position : layer.others)
+        {
+            append_bytes(output, position, 2);
+            append_bytes(output, layer.grid.codes[position], code_bytes);
+        }
+
+        return output;
+    }
+
+    size_t mask_start = output.size();
+    output.resize(mask_start + (tiles + 7) / 8, 0);
+    for (int position : layer.others)
+    {
+        output[mask_start + position / 8] |= (char)(0x80 >> (position % 8));
+    }
+
+    for (int position : layer.others)
+    {
+        append_bytes(output, layer.grid.codes[position], code_bytes);
+    }
+
+    return output;
+}
+
+/*
+* Encode the map and its layers in one pass: each task takes a strip index and encodes that strip of every layer, so
+* the layers go through the thread pool together in the same strip order.  A strip only looks back at the grid's
+* strip before it, never at encoded output, so strips don't depend on each other.  Every layer's strips also go into a
+* binary per orientation laid out little endian as: the number of layers, then for each layer its name length (1
+* byte), name, how it's coded (1 byte: 0 for strips, 1 for sparse), strip count (2 bytes) and the offset of each of its
+* strips from the start of the file (4 bytes), then the strips themselves, strip 0 of every layer that has one in order
+* followed by strip 1 and so on.  The map itself is the layer named tiles.  A layer that's mostly one tile is coded
+* sparse instead whenever that's smaller than its strips, as a single strip of sparse_encode's output, and when sparse
+* beats the smallest its strips could possibly be they're never encoded at all.
+*/
+void encode_layers(const EncoderSettings& settings, const EncoderSettings& base_settings, EncoderState& state, StripCache* cache)
+{
+    int height = state.grid.height;
+    int width = state.grid.width;
+
+    vector<const TileGrid*> grids = { &state.grid };
+    vector<EncoderSettings> layer_settings = { settings };
+    vector<string> names = { "tiles" };
+    vector<vector<char>> sparse = { vector<char>() };
+    vector<bool> strips_needed = { true };
+    for (auto& layer : state.layers)
+    {
+        grids.push_back(&layer.grid);
+        layer_settings.push_back(grid_settings(layer.grid, base_settings));
+        names.push_back(layer.name);
+        sparse.push_back(sparse_encode(layer, settings.code_width));
+
+        // Every strip takes at least a header and an end marker
+        const EncoderSettings& layer_setting = layer_settings.back();
+        size_t word_bytes = layer_setting.codec == "nibble" ? 1 : layer_setting.code_width / 8;
+        strips_needed.push_back(sparse.back().size() > 2 * word_bytes * min(width, height));
+    }
+
+    vector<vector<string>> horizontal(grids.size(), vector<string>(height));
+    vector<vector<string>> vertical(grids.size(), vector<string>(width));
+    vector<vector<StripStats>> layer_horizontal_stats(grids.size(), vector<StripStats>(height));
+    vector<vector<StripStats>> layer_vertical_stats(grids.size(), vector<StripStats>(width));
+    parallel_for(height + width, [&](size_t i) {
+        bool by_rows = (int)i < height;
+        int strip = by_rows ? (int)i : (int)i - height;
+        for (size_t l = 0; l < grids.size(); l++)
+        {
+            if (!strips_needed[l])
+            {
+                continue;
+            }
+
+            const TileGrid& grid = *grids[l];
+            vector<TileCode> codes = by_rows ? grid.row(strip) : grid.column(strip);
+            vector<TileCode> previous = strip == 0 ? vector<TileCode>(codes.size(), 0) : by_rows ? grid.row(strip - 1) : grid.column(strip - 1);
+            StripStats& stats = by_rows ? layer_horizontal_stats[l][strip] : layer_vertical_stats[l][strip];
+            (by_rows ? horizontal[l][strip] : vertical[l][strip]) = encode_line(codes, previous, layer_settings[l], cache, &stats);
+        }
+    });
+
+    // Sparse has to beat the layer's strips either way round, since the binary for each orientation carries it
+    vector<bool> coded_sparse(grids.size(), false);
+    for (size_t l = 1; l < grids.size(); l++)
+    {
+        size_t horizontal_bytes = 0;
+        size_t vertical_bytes = 0;
+        for (auto& stats : layer_horizontal_stats[l])
+        {
+            horizontal_bytes += stats.encoded.size();
+        }
+
+        for (auto& stats : layer_vertical_stats[l])
+        {
+            vertical_bytes += stats.encoded.size();
+        }
+
+        coded_sparse[l] = !strips_needed[l] || sparse[l].size() < min(horizontal_bytes, vertical_bytes);
+        if (coded_sparse[l])
+        {
+            state.extra_outputs[names[l] + "-sparse"] = { format_coding(vector<uint8_t>(sparse[l].begin(), sparse[l].end())) };
+            cout << "Layer " << names[l] << " is coded sparse in " << sparse[l].size() << " bytes, " << grids[l]->codes.size() - state.layers[l - 1].others.size() << " of its tiles are " << state.layers[l - 1].dominant << endl;
+        }
+    }
+
+    for (bool by_rows : { true, false })
+    {
+        vector<vector<string>>& codings = by_rows ? horizontal : vertical;
+        vector<vector<StripStats>>& stats = by_rows ? layer_horizontal_stats : layer_vertical_stats;
+        vector<vector<vector<char>>> bytes(grids.size());
+        size_t header = 1;
+        size_t most_strips = 0;
+        for (size_t l = 0; l < grids.size(); l++)
+        {
+            if (coded_sparse[l])
+            {
+                bytes[l].push_back(sparse[l]);
+            }
+            else
+            {
+                for (auto& strip : stats[l])
+                {
+                    bytes[l].push_back(strip.encoded);
+                }
+            }
+
+            header += 1 + names[l].size() + 1 + 2 + 4 * bytes[l].size();
+            most_strips = max(most_strips, bytes[l].size());
+        }
+
+        vector<vector<size_t>> starts(grids.size());
+        size_t position = header;
+        for (size_t s = 0; s < most_strips; s++)
+        {
+            for (size_t l = 0; l < grids.size(); l++)
+            {
+                if (s < bytes[l].size())
+                {
+                    starts[l].push_back(position);
+                    position += bytes[l][s].size();
+                }
+            }
+        }
+
+        vector<char> output;
+        append_bytes(output, grids.size(), 1);
+        for (size_t l = 0; l < grids.size(); l++)
+        {
+            append_bytes(output, names[l].size(), 1);
+            output.insert(output.end(), names[l].begin(), names[l].end());
+            append_bytes(output, coded_sparse[l] ? 1 : 0, 1);
+            append_bytes(output, bytes[l].size(), 2);
+            for (size_t start : starts[l])
+            {
+                append_bytes(output, start, 4);
+            }
+        }
+
+        for (size_t s = 0; s < most_strips; s++)
+        {
+            for (size_t l = 0; l < grids.size(); l++)
+            {
+                if (s < bytes[l].size())
+                {
+                    output.insert(output.end(), bytes[l][s].begin(), bytes[l][s].end());
+                }
+            }
+        }
+
+        state.binary_outputs[by_rows ? "layers-horizontal" : "layers-vertical"] = move(output);
+        for (size_t l = 1; l < grids.size(); l++)
+        {
+            if (!coded_sparse[l])
+            {
+                state.extra_outputs[names[l] + (by_rows ? "-horizontal" : "-vertical")] = codings[l];
+            }
+        }
+    }
+
+    state.horizontal_codings = move(horizontal[0]);
+    state.vertical_codings = move(vertical[0]);
+    state.horizontal_stats = move(layer_horizontal_stats[0]);
+    state.vertical_stats = move(layer_vertical_stats[0]);
+}
+
+/*
+* Code each frame after the first as the tiles that changed from the frame before it, a line per frame laid out like a
+* sparse layer's list: the number of changes (2 bytes), then each one's position (2 bytes, y * width + x) and code at
+* the code width, little endian.  A last line takes the last frame back to the first so the animation can loop.
+*/
+void encode_frames(int code_width, EncoderState& state)
+{
+    vector<const TileGrid*> sequence = { &state.grid };
+    for (auto& frame : state.frames)
+    {
+        sequence.push_back(&frame);
+    }
+
+    sequence.push_back(&state.grid);
+
+    vector<string>& lines = state.extra_outputs["frames"];
+    lines.clear();
+    size_t delta_bytes = 0;
+    for (size_t f = 1; f < sequence.size(); f++)
+    {
+        const vector<TileCode>& before = sequence[f - 1]->codes;
+        const vector<TileCode>& after = sequence[f]->codes;
+        vector<int> changes;
+        for (size_t i = 0; i < after.size(); i++)
+        {
+            if (after[i] != before[i])
+            {
+                changes.push_back((int)i);
+            }
+        }
+
+        vector<char> delta;
+        append_bytes(delta, changes.size(), 2);
+        for (int position : changes)
+        {
+            append_bytes(delta, position, 2);
+            append_bytes(delta, after[position], code_width / 8);
+        }
+
+        lines.push_back(format_coding(vector<uint8_t>(delta.begin(), delta.end())));
+        delta_bytes += delta.size();
+    }
+
+    size_t full_bytes = 0;
+    for (auto& strip : state.horizontal_stats)
+    {
+        full_bytes += strip.encoded.size();
+    }
+
+    cout << "Coded " << state.frames.size() + 1 << " frames as " << full_bytes << " bytes for the first and " << delta_bytes << " bytes of changes" << endl;
+}
+
+/*
+* Encode the map and every plane riding along with it
+*/
+void encode_state(const EncoderSettings& base_settings, EncoderState& state, StripCache* cache)
+{
+    EncoderSettings settings = grid_settings(state.grid, base_settings);
+    if (settings.codec != base_settings.codec)
+    {
+        cout << "Map uses more than 16 codes, too many to nibble pack, so it's coded with " << settings.codec << " RLE" << endl;
+    }
+
+    if (state.layers.empty())
+    {
+        encode_map(state.grid, settings, cache, state.horizontal_codings, state.vertical_codings, &state.horizontal_stats, &state.vertical_stats);
+    }
+    else
+    {
+        encode_layers(settings, base_settings, state, cache);
+    }
+
+    if (settings.cycle_report)
+    {
+        state.extra_outputs["cycles"] = cycle_report(settings, state.horizontal_stats, state.vertical_stats);
+    }
+
+    // Delta coded strips are decoded one after another anyway, but an engine can still jump straight to the one it's at
+    if (settings.codec == "delta" && !state.grid.codes.empty())
+    {
+        state.extra_outputs["horizontal-index"] = { strip_index(state.horizontal_stats) };
+        state.extra_outputs["vertical-index"] = { strip_index(state.vertical_stats) };
+    }
+
+    if (!settings.entropy.empty() && !state.grid.codes.empty())
+    {
+        // Codec output at the width it was written at; tile codes at the code width
+        int word_bytes = settings.entropy == "tiles" ? settings.code_width / 8 : settings.codec == "nibble" || settings.code_width == 8 ? 1 : 2;
+        for (bool horizontal : { true, false })
+        {
+            string name = horizontal ? "horizontal" : "vertical";
+            vector<vector<uint16_t>> strips = entropy_strips(state.grid, horizontal ? state.horizontal_stats : state.vertical_stats, word_bytes, horizontal, settings.entropy);
+            vector<char>& coded = state.binary_outputs[name + "-huffman"];
+            coded = entropy_code(strips, settings.entropy);
+
+            size_t symbol_count = 0;
+            for (auto& strip : strips)
+            {
+                symbol_count += strip.size();
+            }
+
+            cout << "Huffman coded " << name << " " << settings.entropy << ": " << symbol_count * word_bytes << " bytes to " << coded.size() << endl;
+            if (settings.benchmark)
+            {
+                benchmark_entropy(name, strips, word_bytes);
+            }
+        }
+    }
+
+    if (!state.frames.empty())
+    {
+        encode_frames(settings.code_width, state);
+    }
+
+    if (settings.chunk_screens)
+    {
+        encode_screens(state.grid, settings, cache, state.extra_outputs["screens"], state.extra_outputs["screen-index"], state.extra_outputs["screen-orientations"]);
+        if (settings.screen_orientation.empty())
+        {
+            state.extra_outputs.erase("screen-orientations");
+        }
+    }
+
+    for (auto& plane : state.planes)
+    {
+        EncoderSettings plane_settings = grid_settings(plane.second, base_settings);
+        if (plane.first == "attributes")
+        {
+            // Attributes are NES bytes whatever the code width of the map
+            plane_settings.code_width = 8;
+        }
+
+        vector<StripStats> plane_horizontal_stats;
+        vector<StripStats> plane_vertical_stats;
+        encode_map(plane.second, plane_settings, cache, state.extra_outputs[plane.first + "-horizontal"], state.extra_outputs[plane.first + "-vertical"],
+            &plane_horizontal_stats, &plane_vertical_stats);
+
+        // Attribute strips get loaded as the screen scrolls, so an engine needs to find any one of them
+        if (plane.first == "attributes" && !plane.second.codes.empty())
+        {
+            state.extra_outputs["attributes-horizontal-index"] = { strip_index(plane_horizontal_stats) };
+            state.extra_outputs["attributes-vertical-index"] = { strip_index(plane_vertical_stats) };
+        }
+    }
+
+    if (cache)
+    {
+        cache->trim();
+    }
+}
+
+void write_codings(const string& filename, const vector<string>& codings)
+{
+    ofstream output;
+    output.open(filename);
+    for (auto& coding : codings)
+    {
+        output << coding << endl;
+    }
+
+    output.close();
+}
+
+void write_binary(const string& filename, const vector<char>& data)
+{
+    ofstream output;
+    output.open(filename, ios::binary);
+    output.write(data.data(), data.size());
+    output.close();
+}
+
+/*
+* Break a map with too many tiles into screen aligned regions.  The base bank gets codes from 0 in metatile_codes and
+* each region's own tiles are numbered after it, so a region's strips only use codes from the base bank and its own
+* bank.  Each region is encoded as its own plane and the bank table has a line per region of: first screen, number of
+* screens, first code of the region's bank, and number of tiles in it.  These are always written as 16-bit words
+* since a long map can have more than 255 screens even when the codes are 8-bit.
+*/
+bool split_map(const EncoderSettings& settings, int width, int height, EncoderState& state)
+{
+    // In the same order codes would have been, so each region's own tiles keep that order
+    vector<string> id_tiles = order_tiles(state.tiles, settings.frequency_order, state.format);
+    unordered_map<string, int> ids;
+    for (size_t i = 0; i < id_tiles.size(); i++)
+    {
+        ids[id_tiles[i]] = (int)i;
+    }
+
+    vector<int> grid_ids;
+    for (auto& tile : state.tiles)
+    {
+        grid_ids.push_back(ids[tile]);
+    }
+
+    // Split along whichever way the map is longest, e.g. screens across a side scrolling level
+    bool split_columns = width >= height;
+    int screen_size = max(1, (split_columns ? settings.screen_width : settings.screen_height) / settings.metatile_size);
+    RegionPartition partition;
+    if (!split_regions(grid_ids, width, height, screen_size, split_columns, 1 << settings.code_width, partition))
+    {
+        return false;
+    }
+
+    state.metatile_codes.clear();
+    for (size_t i = 0; i < partition.base_tiles.size(); i++)
+    {
+        state.metatile_codes[id_tiles[partition.base_tiles[i]]] = (TileCode)i;
+    }
+
+    state.grid = TileGrid();
+    state.region_codes.clear();
+    vector<string>& banks = state.extra_outputs["banks"];
+    banks.clear();
+    for (size_t r = 0; r < partition.regions.size(); r++)
+    {
+        const Region& region = partition.regions[r];
+        map<string, TileCode> region_codes;
+        for (size_t i = 0; i < region.local_tiles.size(); i++)
+        {
+            region_codes[id_tiles[region.local_tiles[i]]] = (TileCode)(partition.base_tiles.size() + i);
+        }
+
+        int first = region.start * screen_size;
+        int last = min(split_columns ? width : height, region.end * screen_size);
+        TileGrid grid;
+        grid.width = split_columns ? last - first : width;
+        grid.height = split_columns ? height : last - first;
+        for (int y = 0; y < grid.height; y++)
+        {
+            for (int x = 0; x < grid.width; x++)
+            {
+                const string& tile = split_columns ? state.tiles[y * width + first + x] : state.tiles[(first + y) * width + x];
+                auto code = state.metatile_codes.find(tile);
+                grid.codes.push_back(code != state.metatile_codes.end() ? code->second : region_codes.at(tile));
+            }
+        }
+
+        state.planes["region" + to_string(r)] = grid;
+        state.region_codes.push_back(region_codes);
+        banks.push_back(format_codes({ (TileCode)region.start, (TileCode)(region.end - region.start), (TileCode)partition.base_tiles.size(), (TileCode)region.local_tiles.size() }, 16));
+    }
+
+    cout << "Split map into " << partition.regions.size() << " regions sharing " << partition.base_tiles.size() << " base tiles" << endl;
+    return true;
+}
+
+/*
+* Build each level above the tiles out of 2x2 blocks of the level below, working only from the codes of the level
+* below rather than going back to pixels.  grid comes in as the tile codes and leaves as the codes of the top level.
+* Codes are handed out in the order blocks first show up, upper left first, and each level's dictionary (output as
+* level<size>) has a line per code of its children: upper left, upper right, lower left, lower right.
+*/
+bool build_levels(const EncoderSettings& settings, TileGrid& grid, map<string, vector<string>>& extra_outputs)
+{
+    int size = settings.metatile_size;
+    for (int level = 1; level < settings.levels; level++)
+    {
+        size *= 2;
+        if (grid.width % 2 || grid.height % 2)
+        {
+            cout << "Map doesn't divide evenly into " << size << "x" << size << " metatiles" << endl;
+            return false;
+        }
+
+        TileGrid parent{ grid.width / 2, grid.height / 2, vector<TileCode>() };
+        unordered_map<uint64_t, TileCode> codes;
+        vector<string>& dictionary = extra_outputs["level" + to_string(size)];
+        dictionary.clear();
+        for (int y = 0; y < parent.height; y++)
+        {
+            for (int x = 0; x < parent.width; x++)
+            {
+                const TileCode* upper = &grid.codes[2 * y * grid.width + 2 * x];
+                const TileCode* lower = upper + grid.width;
+                vector<TileCode> children = { upper[0], upper[1], lower[0], lower[1] };
+
+                // Four 16 bit codes fit exactly in a 64 bit key
+                uint64_t key = 0;
+                for (auto child : children)
+                {
+                    key = (key << 16) | child;
+                }
+
+                auto code = codes.find(key);
+                if (code == codes.end())
+                {
+                    if (codes.size() == (size_t)1 << settings.code_width)
+                    {
+                        cout << "Too many " << size << "x" << size << " metatiles, more than " << codes.size() << " different ones are used" << endl;
+                        return false;
+                    }
+
+                    code = codes.emplace(key, (TileCode)codes.size()).first;
+                    dictionary.push_back(format_codes(children, settings.code_width));
+                }
+
+                parent.codes.push_back(code->second);
+            }
+        }
+
+        grid = move(parent);
+    }
+
+    return true;
+}
+
+/*
+* How the map tiles with the grid starting at an offset
+*/
+struct OffsetScore
+{
+    int offset_x;     // in pixels
+    int offset_y;     // in pixels
+    int columns;      // whole tiles covered at this offset
+    int rows;
+    size_t covered;   // pixels in those tiles
+    size_t dropped;   // pixels past them, which don't get encoded
+    size_t tiles;     // unique tiles
+    size_t bytes = 0; // in whichever orientation encodes smaller, 0 if there are too many tiles for 16 bit codes
+};
+
+/*
+* Scale a tile count or encoded size at an offset up to the whole map, as if the dropped pixels tiled and encoded like
+* the rest.  Offsets are compared on these so one can't come out ahead just by leaving more of the map out.
+*/
+size_t whole_map(size_t value, const OffsetScore& score)
+{
+    return (value * (score.covered + score.dropped) + score.covered - 1) / score.covered;
+}
+
+/*
+* Mix a pixel value so similar colors don't give similar hashes
+*/
+uint64_t mix_pixel(uint64_t value)
+{
+    value += 0x9E3779B97F4A7C15ull;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    return value ^ (value >> 31);
+}
+
+/*
+* Score every offset of the tile grid within a tile.  Rather than stringify the map's tiles once per offset, every
+* tile sized window of the map is hashed in two rolling passes, along the rows and then down the columns, and each
+* offset just picks out the windows on its grid.  Offsets are then scored in parallel.  Unique tile counts come from
+* hashes, so they're estimates; encoding at an offset goes back to comparing pixels.  Offsets that leave no whole tile
+* in a row or column aren't scored.
+*/
+vector<OffsetScore> score_offsets(CBitmap& bitmap, int tile_size)
+{
+    int width = bitmap.GetWidth();
+    int height = bitmap.GetHeight();
+    if (width < tile_size || height < tile_size)
+    {
+        return {};
+    }
+
+    // Top down pixel values that compare the same way tile strings do
+    vector<uint64_t> pixels(width * height);
+    for (int y = 0; y < height; y++)
+    {
+        int row = (height - 1 - y) * width;
+        for (int x = 0; x < width; x++)
+        {
+            if (bitmap.IsIndexed())
+            {
+                pixels[y * width + x] = mix_pixel(bitmap.GetIndices()[row + x]);
+            }
+            else
+            {
+                const RGBA& pixel = ((RGBA*)bitmap.GetBits())[row + x];
+                pixels[y * width + x] = mix_pixel(pack_color(pixel.Red, pixel.Green, pixel.Blue));
+            }
+        }
+    }
+
+    const uint64_t row_base = 0x100000001B3ull;
+    const uint64_t column_base = 0x9E3779B97F4A7C15ull;
+    uint64_t row_power = 1;
+    uint64_t column_power = 1;
+    for (int i = 1; i < tile_size; i++)
+    {
+        row_power *= row_base;
+        column_power *= column_base;
+    }
+
+    int span_width = width - tile_size + 1;
+    int span_height = height - tile_size + 1;
+    vector<uint64_t> row_hashes(span_width * height);
+    for (int y = 0; y < height; y++)
+    {
+        const uint64_t* row = &pixels[y * width];
+        uint64_t hash = 0;
+        for (int x = 0; x < tile_size; x++)
+        {
+            hash = hash * row_base + row[x];
+        }
+
+        row_hashes[y * span_width] = hash;
+        for (int x = 1; x < span_width; x++)
+        {
+            hash = (hash - row[x - 1] * row_power) * row_base + row[x + tile_size - 1];
+            row_hashes[y * span_width + x] = hash;
+        }
+    }
+
+    vector<uint64_t> windows(span_width * span_height);
+    for (int x = 0; x < span_width; x++)
+    {
+        uint64_t hash = 0;
+        for (int y = 0; y < tile_size; y++)
+        {
+            hash = hash * column_base + row_hashes[y * span_width + x];
+        }
+
+        windows[x] = hash;
+        for (int y = 1; y < span_height; y++)
+        {
+            hash = (hash - row_hashes[(y - 1) * span_width + x] * column_power) * column_base + row_hashes[(y + tile_size - 1) * span_width + x];
+            windows[y * span_width + x] = hash;
+        }
+    }
+
+    vector<OffsetScore> scores;
+    for (int offset_y = 0; offset_y < tile_size; offset_y++)
+    {
+        for (int offset_x = 0; offset_x < tile_size; offset_x++)
+        {
+            OffsetScore score;
+            score.offset_x = offset_x;
+            score.offset_y = offset_y;
+            score.columns = (width - offset_x) / tile_size;
+            score.rows = (height - offset_y) / tile_size;
+            if (score.columns && score.rows)
+            {
+                score.covered = (size_t)score.columns * score.rows * tile_size * tile_size;
+                score.dropped = (size_t)width * height - score.covered;
+                scores.push_back(score);
+            }
+        }
+    }
+
+    parallel_for(scores.size(), [&](size_t i) {
+        OffsetScore& score = scores[i];
+        unordered_map<uint64_t, TileCode> ids;
+        TileGrid grid{ score.columns, score.rows, vector<TileCode>() };
+        for (int r = 0; r < score.rows; r++)
+        {
+            for (int c = 0; c < score.columns; c++)
+            {
+                uint64_t window = windows[(score.offset_y + r * tile_size) * span_width + score.offset_x + c * tile_size];
+                grid.codes.push_back(ids.emplace(window, (TileCode)ids.size()).first->second);
+            }
+        }
+
+        score.tiles = ids.size();
+        if (score.tiles > 1 << 16)
+        {
+            return;
+        }
+
+        int code_width = score.tiles > 256 ? 16 : 8;
+        size_t horizontal = 0;
+        size_t vertical = 0;
+        for (int y = 0; y < grid.height; y++)
+        {
+            horizontal += encoded_size(grid.row(y), code_width);
+        }
+
+        for (int x = 0; x < grid.width; x++)
+        {
+            vertical += encoded_size(grid.column(x), code_width);
+        }
+
+        score.bytes = min(horizontal, vertical);
+    });
+
+    return scores;
+}
+
+/*
+* The offset to encode at: of the ones with few enough tiles for the code width, the one with the smallest encoding
+* scaled up to the whole map, then the fewest pixels dropped and then the fewest tiles.  nullptr if none fit.
+*/
+const OffsetScore* best_offset(const vector<OffsetScore>& scores, int code_width)
+{
+    const OffsetScore* best = nullptr;
+    for (auto& score : scores)
+    {
+        if (score.tiles > (size_t)1 << code_width || !score.bytes)
+        {
+            continue;
+        }
+
+        if (!best)
+        {
+            best = &score;
+            continue;
+        }
+
+        size_t bytes = whole_map(score.bytes, score);
+        size_t best_bytes = whole_map(best->bytes, *best);
+        if (bytes != best_bytes)
+        {
+            if (bytes < best_bytes)
+            {
+                best = &score;
+            }
+        }
+        else if (score.dropped != best->dropped)
+        {
+            if (score.dropped < best->dropped)
+            {
+                best = &score;
+            }
+        }
+        else if (score.tiles < best->tiles)
+        {
+            best = &score;
+        }
+    }
+
+    return best;
+}
+
+/*
+* Lossily bring the map down to max_tiles distinct tiles by merging the ones that differ by the fewest pixels, swapping
+* each merged tile out everywhere it's used.  Tiles are compared as they'll be coded, so after flips and palettes have
+* been taken out.  The merges output has a line per tile merged away, giving where it first shows up, where the tile that
+* replaced it first shows up, how many pixels differ and how many times it was used.
+*/
+void merge_near_duplicates(int max_tiles, int tile_size, EncoderState& state)
+{
+    vector<string> distinct;
+    unordered_map<string, int> ids;
+    vector<int> first_seen;
+    vector<int> uses;
+    for (size_t i = 0; i < state.tiles.size(); i++)
+    {
+        auto found = ids.emplace(state.tiles[i], (int)distinct.size());
+        if (found.second)
+        {
+            distinct.push_back(state.tiles[i]);
+            first_seen.push_back((int)i);
+            uses.push_back(0);
+        }
+
+        uses[found.first->second]++;
+    }
+
+    if (distinct.size() <= (size_t)max_tiles)
+    {
+        return;
+    }
+
+    vector<vector<uint32_t>> pixels(distinct.size());
+    parallel_for(distinct.size(), [&](size_t i) { pixels[i] = tile_pixels(distinct[i], state.format, tile_size); });
+    vector<int> into = merge_tiles(pixels, uses, max_tiles);
+
+    auto position = [&](int tile) {
+        stringstream ss;
+        ss << "(" << first_seen[tile] % state.width << ", " << first_seen[tile] / state.width << ")";
+        return ss.str();
+    };
+
+    vector<string>& report = state.extra_outputs["merges"];
+    long long changed = 0;
+    for (size_t tile = 0; tile < distinct.size(); tile++)
+    {
+        if (into[tile] == (int)tile)
+        {
+            continue;
+        }
+
+        int distance = pixel_distance(pixels[tile].data(), pixels[into[tile]].data(), pixels[tile].size());
+        changed += (long long)distance * uses[tile];
+        report.push_back(position((int)tile) + " -> " + position(into[tile]) + ": " + to_string(distance) + " pixels differ, used " + to_string(uses[tile]) + " times");
+    }
+
+    for (auto& tile : state.tiles)
+    {
+        tile = distinct[into[ids[tile]]];
+    }
+
+    cout << "Merged " << report.size() << " tiles into others to get down to " << max_tiles << ", changing " << changed << " pixels" << endl;
+}
+
+/*
+* Read every layer's tiles on the map's tile grid.  Layers have to be the same size as the map.  With combined codes
+* their tiles have to be read the same way as the map's so they can share its dictionary.
+*/
+bool load_layers(const EncoderSettings& settings, EncoderState& state)
+{
+    state.layers.clear();
+    for (auto& entry : settings.layers)
+    {
+        shared_ptr<CBitmap> bitmap;
+        if (!load_map(entry.second, 0, bitmap))
+        {
+            return false;
+        }
+
+        if (bitmap->GetWidth() != state.bitmap->GetWidth() || bitmap->GetHeight() != state.bitmap->GetHeight())
+        {
+            cout << "Layer " << entry.first << " is " << bitmap->GetWidth() << "x" << bitmap->GetHeight() << ", not the same size as the map" << endl;
+            return false;
+        }
+
+        MapLayer layer;
+        layer.name = entry.first;
+        if (!get_tile_format(*bitmap, 0, layer.format) ||
+            !identify_tiles(*bitmap, layer.format, settings.metatile_size, state.offset_x, state.offset_y, layer.tiles))
+        {
+            return false;
+        }
+
+        if (settings.combined_layer_codes && (layer.format.indexed != state.source_format.indexed || !same_palette(layer.format, state.source_format)))
+        {
+            cout << "Layer " << layer.name << " doesn't use the same colors as the map, so it can't share its codes" << endl;
+            return false;
+        }
+
+        if (!settings.combined_layer_codes && !generate_metatile_codes(layer.tiles, settings.code_width, settings.frequency_order, layer.format, layer.codes))
+        {
+            return false;
+        }
+
+        state.layers.push_back(move(layer));
+    }
+
+    return true;
+}
+
+/*
+* Read the tiles of every frame after the first on the map's tile grid and in the map's format, so they can share its
+* codes.  Frames have to be the same size as the map and use its colors, after quantizing to the same palette if asked.
+*/
+bool load_frames(const EncoderSettings& settings, const vector<BGRA>& palette, EncoderState& state)
+{
+    state.frame_tiles.clear();
+    if (!settings.frames.empty() && (size_t)state.width * state.height > 0xFFFF)
+    {
+        cout << "Frames can only be coded for maps of up to 65535 tiles, this one has " << (size_t)state.width * state.height << endl;
+        return false;
+    }
+
+    for (auto& frame_name : settings.frames)
+    {
+        shared_ptr<CBitmap> bitmap;
+        if (!load_map(frame_name, 0, bitmap))
+        {
+            return false;
+        }
+
+        if (bitmap->GetWidth() != state.bitmap->GetWidth() || bitmap->GetHeight() != state.bitmap->GetHeight())
+        {
+            cout << "Frame " << frame_name << " is " << bitmap->GetWidth() << "x" << bitmap->GetHeight() << ", not the same size as the map" << endl;
+            return false;
+        }
+
+        if (settings.quantize && !quantize_map(*bitmap, palette, state.offset_x, state.offset_y))
+        {
+            return false;
+        }
+
+        // Indices only mean the same thing under the same palette; truecolor is checked a pixel at a time as tiles are read
+        TileFormat format;
+        if (!get_tile_format(*bitmap, 0, format) || bitmap->IsIndexed() != state.bitmap->IsIndexed() || (format.indexed && !same_palette(format, state.source_format)))
+        {
+            cout << "Frame " << frame_name << " doesn't use the same colors as the map" << endl;
+            return false;
+        }
+
+        state.frame_tiles.push_back(vector<string>());
+        if (!identify_tiles(*bitmap, state.source_format, settings.metatile_size, state.offset_x, state.offset_y, state.frame_tiles.back()))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+* Find the tile most of a layer is and where all the others are, while the grid's fresh, so a mostly empty layer can
+* be coded from just the tiles that aren't empty
+*/
+void find_sparse_tiles(MapLayer& layer)
+{
+    unordered_map<TileCode, size_t> counts;
+    for (TileCode code : layer.grid.codes)
+    {
+        counts[code]++;
+    }
+
+    size_t most = 0;
+    for (auto& entry : counts)
+    {
+        if (entry.second > most || (entry.second == most && entry.first < layer.dominant))
+        {
+            layer.dominant = entry.first;
+            most = entry.second;
+        }
+    }
+
+    layer.others.clear();
+    for (size_t i = 0; i < layer.grid.codes.size(); i++)
+    {
+        if (layer.grid.codes[i] != layer.dominant)
+        {
+            layer.others.push_back((int)i);
+        }
+    }
+}
+
+/*
+* Bring everything downstream of the inputs that changed up to date, leaving the rest as it was
+*/
+bool update_state(const EncoderSettings& settings, EncoderState& state, bool map_changed, bool mappings_changed)
+{
+    if (map_changed)
+    {
+        // Off the upper left the map can't divide evenly, so anything past the last whole tile gets dropped
+        bool offset = settings.auto_offset || settings.offset_x || settings.offset_y;
+        if (!load_map(settings.map_name, offset ? 0 : settings.metatile_size << (settings.levels - 1), state.bitmap))
+        {
+            return false;
+        }
+
+        state.offset_x = settings.offset_x;
+        state.offset_y = settings.offset_y;
+        if (settings.auto_offset)
+        {
+            vector<OffsetScore> scores = score_offsets(*state.bitmap, settings.metatile_size);
+            const OffsetScore* best = best_offset(scores, settings.code_width);
+            if (!best)
+            {
+                cout << "No offset gives few enough tiles for " << settings.code_width << " bit codes" << endl;
+                return false;
+            }
+
+            state.offset_x = best->offset_x;
+            state.offset_y = best->offset_y;
+            cout << "Encoding at offset (" << state.offset_x << ", " << state.offset_y << ")" << endl;
+        }
+
+        state.width = (state.bitmap->GetWidth() - state.offset_x) / settings.metatile_size;
+        state.height = (state.bitmap->GetHeight() - state.offset_y) / settings.metatile_size;
+
+        // Frames get snapped to the same colors as the map
+        vector<BGRA> palette;
+        if (settings.quantize)
+        {
+            palette = settings.quantize_palette.empty() ? detect_palette(*state.bitmap) : settings.quantize_palette;
+            if (!quantize_map(*state.bitmap, palette, state.offset_x, state.offset_y))
+            {
+                return false;
+            }
+        }
+
+        // Palette relative tiles get packed once they've been remapped, not as they come out of the map
+        vector<set<uint32_t>> area_colors;
+        if (!get_tile_format(*state.bitmap, settings.relative_palettes ? 0 : settings.depth, state.source_format) ||
+            !identify_tiles(*state.bitmap, state.source_format, settings.metatile_size, state.offset_x, state.offset_y, state.tiles, settings.attributes ? &area_colors : nullptr))
+        {
+            return false;
+        }
+
+        state.format = state.source_format;
+        state.planes.clear();
+        state.region_codes.clear();
+        state.extra_outputs.clear();
+        state.binary_outputs.clear();
+
+        int areas_across = (state.width * settings.metatile_size + attribute_size - 1) / attribute_size;
+        if (settings.attributes && !build_attributes(area_colors, areas_across, state.source_format, state.planes["attributes"], state.extra_outputs["attribute-palettes"]))
+        {
+            return false;
+        }
+
+        int width = state.width;
+        int height = state.height;
+        if (settings.flips)
+        {
+            state.planes["flips"] = TileGrid{ width, height, vector<TileCode>() };
+        }
+
+        if (settings.relative_palettes)
+        {
+            state.planes["palettes"] = TileGrid{ width, height, vector<TileCode>() };
+            vector<TileCode>* flips = settings.flips ? &state.planes["flips"].codes : nullptr;
+            if (!canonicalize_palettes(state.tiles, width, settings.metatile_size, settings.depth, state.format, state.planes["palettes"].codes, flips, state.extra_outputs["palettes"]))
+            {
+                return false;
+            }
+        }
+        else if (settings.flips)
+        {
+            canonicalize_flips(state.tiles, state.format, settings.metatile_size, state.planes["flips"].codes);
+        }
+
+        if (settings.max_tiles)
+        {
+            merge_near_duplicates(settings.max_tiles, settings.metatile_size, state);
+        }
+
+        if (!load_layers(settings, state) || !load_frames(settings, palette, state))
+        {
+            return false;
+        }
+    }
+
+    // Mapped tiles are stored in the map's format, so a new map (and maybe a new palette) means redoing them too
+    if (!settings.file_of_mappings.empty() && (mappings_changed || map_changed))
+    {
+        state.metatile_codes.clear();
+        if (!populate_metatile_codes(settings.file_of_mappings, settings, state.source_format, state.format, state.metatile_codes))
+        {
+            return false;
+        }
+
+        state.codes_from_mappings = !state.metatile_codes.empty();
+    }
+
+    int width = state.width;
+    int height = state.height;
+
+    // If we weren't provided metatile code mappings calculate it ourselves; they depend on the map so redo them whenever it changes
+    if (!state.codes_from_mappings && (map_changed || state.metatile_codes.empty()))
+    {
+        if (settings.split && set<string>(state.tiles.begin(), state.tiles.end()).size() > (size_t)1 << settings.code_width)
+        {
+            return split_map(settings, width, height, state);
+        }
+
+        // A combined dictionary is built from the map and every layer as if they were one big map, and so is an animation's
+        vector<string> dictionary_tiles = state.tiles;
+        for (auto& layer : state.layers)
+        {
+            if (settings.combined_layer_codes)
+            {
+                dictionary_tiles.insert(dictionary_tiles.end(), layer.tiles.begin(), layer.tiles.end());
+            }
+        }
+
+        for (auto& frame : state.frame_tiles)
+        {
+            dictionary_tiles.insert(dictionary_tiles.end(), frame.begin(), frame.end());
+        }
+
+        if (!generate_metatile_codes(dictionary_tiles, settings.code_width, settings.frequency_order, state.format, state.metatile_codes))
+        {
+            return false;
+        }
+    }
+
+    for (auto& layer : state.layers)
+    {
+        if (!build_tile_grid(layer.tiles, width, height, settings.combined_layer_codes ? state.metatile_codes : layer.codes, layer.grid))
+        {
+            return false;
+        }
+
+        find_sparse_tiles(layer);
+    }
+
+    state.frames.assign(state.frame_tiles.size(), TileGrid());
+    for (size_t f = 0; f < state.frame_tiles.size(); f++)
+    {
+        if (!build_tile_grid(state.frame_tiles[f], width, height, state.metatile_codes, state.frames[f]))
+        {
+            return false;
+        }
+    }
+
+    return build_tile_grid(state.tiles, width, height, state.metatile_codes, state.grid) && build_levels(settings, state.grid, state.extra_outputs);
+}
+
+/*
+* Remove the tile bitmap of every code in old_codes that isn't in codes any more
+*/
+void remove_stale_tiles(const map<string, TileCode>& old_codes, const map<string, TileCode>& codes, const string& output_base)
+{
+    set<TileCode> current;
+    for (auto& entry : codes)
+    {
+        current.insert(entry.second);
+    }
+
+    for (auto& entry : old_codes)
+    {
+        if (!current.count(entry.second))
+        {
+            stringstream ss;
+            ss << output_base << "-tile" << entry.second << ".bmp";
+            remove(ss.str().c_str());
+        }
+    }
+}
+
+/*
+* Write out everything that differs from previous; pass nullptr to write it all.  Returns how many files were written.
+*/
+int write_outputs(const EncoderState& state, const EncoderState* previous, int metatile_size, const string& output_base)
+{
+    // A split map only has its regions
+    bool whole_map = !state.grid.codes.empty();
+
+    int written = 0;
+    if (whole_map && (!previous || previous->horizontal_codings != state.horizontal_codings))
+    {
+        write_codings(output_base + "-horizontal.txt", state.horizontal_codings);
+        written++;
+    }
+
+    if (whole_map && (!previous || previous->vertical_codings != state.vertical_codings))
+    {
+        write_codings(output_base + "-vertical.txt", state.vertical_codings);
+        written++;
+    }
+
+    for (auto& plane : state.extra_outputs)
+    {
+        if (previous)
+        {
+            auto old = previous->extra_outputs.find(plane.first);
+            if (old != previous->extra_outputs.end() && old->second == plane.second)
+            {
+                continue;
+            }
+        }
+
+        write_codings(output_base + "-" + plane.first + ".txt", plane.second);
+        written++;
+    }
+
+    for (auto& output : state.binary_outputs)
+    {
+        if (previous)
+        {
+            auto old = previous->binary_outputs.find(output.first);
+            if (old != previous->binary_outputs.end() && old->second == output.second)
+            {
+                continue;
+            }
+        }
+
+        write_binary(output_base + "-" + output.first + ".bin", output.second);
+        written++;
+    }
+
+    for (auto& entry : state.metatile_codes)
+    {
+        if (previous)
+        {
+            auto old = previous->metatile_codes.find(entry.first);
+            if (old != previous->metatile_codes.end() && old->second == entry.second)
+            {
+                continue;
+            }
+        }
+
+        output_bitmap(entry.first, entry.second, metatile_size, output_base, state.format);
+        written++;
+    }
+
+    for (size_t l = 0; l < state.layers.size(); l++)
+    {
+        const MapLayer& layer = state.layers[l];
+        if (previous && l < previous->layers.size() && previous->layers[l].codes == layer.codes)
+        {
+            continue;
+        }
+
+        for (auto& entry : layer.codes)
+        {
+            output_bitmap(entry.first, entry.second, metatile_size, output_base + "-" + layer.name, layer.format);
+            written++;
+        }
+    }
+
+    for (size_t r = 0; r < state.region_codes.size(); r++)
+    {
+        if (previous && r < previous->region_codes.size() && previous->region_codes[r] == state.region_codes[r])
+        {
+            continue;
+        }
+
+        for (auto& entry : state.region_codes[r])
+        {
+            output_bitmap(entry.first, entry.second, metatile_size, output_base + "-region" + to_string(r), state.format);
+            written++;
+        }
+    }
+
+    // Anything that's gone away would leave a stale file behind that no longer matches the map
+    if (previous)
+    {
+        if (!whole_map && !previous->grid.codes.empty())
+        {
+            remove((output_base + "-horizontal.txt").c_str());
+            remove((output_base + "-vertical.txt").c_str());
+        }
+
+        for (auto& plane : previous->extra_outputs)
+        {
+            if (!state.extra_outputs.count(plane.first))
+            {
+                remove((output_base + "-" + plane.first + ".txt").c_str());
+            }
+        }
+
+        for (auto& output : previous->binary_outputs)
+        {
+            if (!state.binary_outputs.count(output.first))
+            {
+                remove((output_base + "-" + output.first + ".bin").c_str());
+            }
+        }
+
+        remove_stale_tiles(previous->metatile_codes, state.metatile_codes, output_base);
+        for (auto& old_layer : previous->layers)
+        {
+            auto layer = find_if(state.layers.begin(), state.layers.end(), [&](const MapLayer& l) { return l.name == old_layer.name; });
+            remove_stale_tiles(old_layer.codes, layer == state.layers.end() ? map<string, TileCode>() : layer->codes, output_base + "-" + old_layer.name);
+        }
+
+        for (size_t r = 0; r < previous->region_codes.size(); r++)
+        {
+            remove_stale_tiles(previous->region_codes[r], r < state.region_codes.size() ? state.region_codes[r] : map<string, TileCode>(), output_base + "-region" + to_string(r));
+        }
+    }
+
+    return written;
+}
+
+void append_chunk(vector<char>& output, const string& name, const vector<char>& data)
+{
+    append_bytes(output, name.size(), 1);
+    output.insert(output.end(), name.begin(), name.end());
+    append_bytes(output, data.size(), 4);
+    output.insert(output.end(), data.begin(), data.end());
+}
+
+/*
+* Every tile in code order as the tile size (2 bytes), bytes per tile (4 bytes) and tile count (4 bytes), then each
+* tile's code (2 bytes) and its tile string
+*/
+vector<char> tile_chunk(const map<string, TileCode>& codes, int tile_size)
+{
+    vector<pair<TileCode, const string*>> ordered;
+    for (auto& entry : codes)
+    {
+        ordered.push_back(make_pair(entry.second, &entry.first));
+    }
+
+    sort(ordered.begin(), ordered.end());
+
+    vector<char> data;
+    append_bytes(data, tile_size, 2);
+    append_bytes(data, ordered.empty() ? 0 : ordered[0].second->size(), 4);
+    append_bytes(data, ordered.size(), 4);
+    for (auto& tile : ordered)
+    {
+        append_bytes(data, tile.first, 2);
+        data.insert(data.end(), tile.second->begin(), tile.second->end());
+    }
+
+    return data;
+}
+
+vector<char> palette_chunk(const TileFormat& format)
+{
+    vector<char> data;
+    for (auto& color : format.palette)
+    {
+        data.push_back((char)color.Red);
+        data.push_back((char)color.Green);
+        data.push_back((char)color.Blue);
+    }
+
+    return data;
+}
+
+/*
+* Write everything write_outputs would as one framed stream instead, so the encoder can sit in a pipeline without temp
+* files.  The stream is "RLEC" followed by chunks of a name length (1 byte), name, data length (4 bytes) and data, with
+* a name length of 0 after the last one.  Everything is little endian.
+*   horizontal, vertical: the map's strips back to back in binary
+*   horizontal-offsets, vertical-offsets: where each strip starts in them (4 bytes each)
+*   tiles: every tile, see tile_chunk.  A tile string is the tile's pixels upper left first, as red, green and blue
+*          bytes for truecolor maps or a palette index each for indexed ones, packed first pixel in the high bits at a
+*          depth
+*   palette: the red, green and blue of each color the indices are into, for indexed maps
+*   <layer>-tiles and <layer>-palette: the same for each layer with its own codes
+*   region<n>-tiles: each region's own bank when split
+*   <output>.txt, <output>.bin: every other output, exactly as its file would have been
+*/
+void write_container(const EncoderState& state, int metatile_size, ostream& stream)
+{
+    vector<char> output = { 'R', 'L', 'E', 'C' };
+    if (!state.grid.codes.empty())
+    {
+        for (bool by_rows : { true, false })
+        {
+            string name = by_rows ? "horizontal" : "vertical";
+            vector<char> strips;
+            vector<char> offsets;
+            for (auto& strip : by_rows ? state.horizontal_stats : state.vertical_stats)
+            {
+                append_bytes(offsets, strips.size(), 4);
+                strips.insert(strips.end(), strip.encoded.begin(), strip.encoded.end());
+            }
+
+            append_chunk(output, name, strips);
+            append_chunk(output, name + "-offsets", offsets);
+        }
+    }
+
+    append_chunk(output, "tiles", tile_chunk(state.metatile_codes, metatile_size));
+    if (state.format.indexed)
     {
-        stringstream ss;
-        ss << "$";
-        ss << setfill('0') << setw(2) << uppercase << hex << (0xff & (unsigned int)el);
-        output.push_back(ss.str());
+        append_chunk(output, "palette", palette_chunk(state.format));
+    }
+
+    for (auto& layer : state.layers)
+    {
+        if (!layer.codes.empty())
+        {
+            append_chunk(output, layer.name + "-tiles", tile_chunk(layer.codes, metatile_size));
+            if (layer.format.indexed)
+            {
+                append_chunk(output, layer.name + "-palette", palette_chunk(layer.format));
+            }
+        }
+    }
+
+    for (size_t r = 0; r < state.region_codes.size(); r++)
+    {
+        append_chunk(output, "region" + to_string(r) + "-tiles", tile_chunk(state.region_codes[r], metatile_size));
+    }
+
+    for (auto& lines : state.extra_outputs)
+    {
+        vector<char> text;
+        for (auto& line : lines.second)
+        {
+            text.insert(text.end(), line.begin(), line.end());
+            text.push_back('\n');
+        }
+
+        append_chunk(output, lines.first + ".txt", text);
+    }
+
+    for (auto& binary : state.binary_outputs)
+    {
+        append_chunk(output, binary.first + ".bin", binary.second);
     }
+
+    output.push_back(0);
+    stream.write(output.data(), output.size());
+    stream.flush();
 }
 
 /*
-* Stringify a tile for easy comparison
+* Stay resident and re-encode whenever the map or the mappings change.  We poll modification times rather than use
+* a platform notification API so this behaves the same on every platform we build for.
 */
-string make_tile_string(const RGBA* bit_start, int width, int tile_size)
+void watch_inputs(const EncoderSettings& settings, EncoderState& state, StripCache* cache)
 {
-    stringstream ss;
-    for (int i = 0; i > -tile_size * width; i -= width)
+    auto modified_time = [](const string& filename) {
+        error_code ec;
+        auto time = filesystem::last_write_time(filename, ec);
+        return ec ? filesystem::file_time_type::min() : time;
+    };
+
+    auto mapping_times = [&]() {
+        vector<filesystem::file_time_type> times;
+        if (!settings.file_of_mappings.empty())
+        {
+            times.push_back(modified_time(settings.file_of_mappings));
+            for (auto& bitmap_filename : read_mapping_bitmaps(settings.file_of_mappings))
+            {
+                times.push_back(modified_time(bitmap_filename));
+            }
+        }
+
+        return times;
+    };
+
+    // Layers and frames are read along with the map, so a change to any of them redoes the map
+    auto map_times = [&]() {
+        vector<filesystem::file_time_type> times = { modified_time(settings.map_name) };
+        for (auto& layer : settings.layers)
+        {
+            times.push_back(modified_time(layer.second));
+        }
+
+        for (auto& frame : settings.frames)
+        {
+            times.push_back(modified_time(frame));
+        }
+
+        return times;
+    };
+
+    auto map_time = map_times();
+    auto mappings_times = mapping_times();
+
+    cout << "Watching " << settings.map_name << " for changes" << endl;
+    while (true)
     {
-        for (int j = i; j < i + tile_size; j++)
+        this_thread::sleep_for(chrono::milliseconds(250));
+
+        auto new_map_time = map_times();
+        auto new_mappings_times = mapping_times();
+        bool map_changed = new_map_time != map_time;
+        bool mappings_changed = new_mappings_times != mappings_times;
+        if (!map_changed && !mappings_changed)
         {
-            const RGBA* pixel = bit_start + j;
-            // Pixel will be converted to three chars in a string, which easily can be turned back into a bitmap with no alpha channel
-            ss << pixel->Red << pixel->Green << pixel->Blue;
+            continue;
         }
-    }
 
-    return ss.str();
+        map_time = new_map_time;
+        mappings_times = new_mappings_times;
+
+        // Work on a copy so a bad save leaves the last good encoding in place while we wait for the next one
+        EncoderState next = state;
+        if (!update_state(settings, next, map_changed, mappings_changed))
+        {
+            continue;
+        }
+
+        encode_state(settings, next, cache);
+
+        int written = write_outputs(next, &state, settings.metatile_size, settings.output_base);
+        cout << "Re-encoded " << settings.map_name << ", " << written << " output(s) updated" << endl;
+        state = move(next);
+    }
 }
 
 /*
-* Output a bitmap for a stringified tile
+* Group a grid of IDs into factor x factor blocks and give each distinct block an ID in the order they first show up.
+* The grid has to divide evenly into blocks.
 */
-void output_bitmap(const string& tile, char code, int tile_size, const string& output_base)
+vector<int> intern_blocks(const vector<int>& ids, int width, int height, int factor, int& count)
 {
-    // Need to reverse the order of rows back to what bitmap is expecting
-    const char* chars = tile.c_str();
-    int length = tile.size();
-    char* bits = new char[length];
-    int k = 0;
-    for (int i = (tile_size - 1) * tile_size * 3; i >= 0; i -= tile_size * 3) // * 3 because each pixel is 3 chars
+    unordered_map<string, int> blocks;
+    vector<int> block_ids;
+    string key(factor * factor * sizeof(int), '\0');
+    for (int y = 0; y < height; y += factor)
     {
-        for (int j = i; j < i + (tile_size * 3); j++)
+        for (int x = 0; x < width; x += factor)
         {
-            bits[k] = chars[j];
-            k++;
+            for (int j = 0; j < factor; j++)
+            {
+                memcpy(&key[j * factor * sizeof(int)], &ids[(y + j) * width + x], factor * sizeof(int));
+            }
+
+            block_ids.push_back(blocks.emplace(key, (int)blocks.size()).first->second);
         }
     }
 
-    CBitmap bitmap;
-    bitmap.SetBits(bits, tile_size, tile_size, 0x0000FF, 0x00FF00, 0xFF0000);
-    stringstream ss;
-    ss << output_base << "-tile" << (int)code << ".bmp";  // need to cast or else it will render the char
-    bitmap.Save(ss.str().c_str(), 24);
-    delete[] bits;
+    count = (int)blocks.size();
+    return block_ids;
 }
 
 /*
-* Coding is Konami RLE
-* 
-* $00-80 - The next byte is repeated n times
-* $81-FE - The next 128-n bytes are literals
-* $FF - End of stream
-* 
-* Need at least three repeated to be worth using the repeated form
-* 
-* Adapted from Python example: https://github.com/sobodash/graveyardduck/blob/master/graveduck.py
-* 
-* Defaults to coding a horizontal row that begins at bit_start, but can instead code a vertical column if height is set.
-* 
-* bit_start - pointer to our initial position in the RGBA array
-* width - how wide a line is
-* tile_size - how big a tile is
-* metatile_codes - mapping of tile_string to encoded identifier
-* height - if greater than zero then set vertical encoding mode and use this as the height of the image
+* Report what the map would cost at each of the sizes to evaluate without encoding it at any of them.  Only the
+* smallest size is hashed from pixels; every bigger size is built from blocks of IDs of a smaller one.  The estimated
+* ROM cost is the smallest size's tile data, plus a table of smallest tile codes per tile for each bigger size, plus
+* the map in whichever orientation encodes smaller.
 */
-string rle_encode(const RGBA* bit_start, int width, int tile_size, const map<string, char>& metatile_codes, int height = 0)
+bool evaluate_sizes(const EncoderSettings& settings)
 {
-    int bit_end = width;
-    int bit_step = tile_size;
-    int sign = 1;
-    if (height > 0)
+    struct SizeLevel
+    {
+        int size;
+        int width = 0;  // in tiles
+        int height = 0; // in tiles
+        int count = 0;
+        vector<int> ids;
+    };
+
+    const vector<int>& sizes = settings.evaluate_sizes;
+    int base_size = sizes[0];
+    shared_ptr<CBitmap> bitmap;
+    TileFormat format;
+    vector<string> tiles;
+    if (!load_map(settings.map_name, base_size, bitmap) ||
+        !get_tile_format(*bitmap, settings.depth, format) ||
+        !identify_tiles(*bitmap, format, base_size, 0, 0, tiles))
     {
-        bit_end = width * height;
-        bit_step = tile_size * width;
-        sign = -1;
+        return false;
     }
 
-    vector<char> final_values;
-    vector<char> running_tiles;
-    int i = 0;
-    while (i < bit_end)
+    vector<SizeLevel> levels(1);
+    levels[0].size = base_size;
+    levels[0].width = bitmap->GetWidth() / base_size;
+    levels[0].height = bitmap->GetHeight() / base_size;
+    unordered_map<string, int> base_ids;
+    for (auto& tile : tiles)
     {
-        string tile_string = make_tile_string(bit_start + (sign * i), width, tile_size);
-        int count = 0;
-        int last = i;
+        levels[0].ids.push_back(base_ids.emplace(tile, (int)base_ids.size()).first->second);
+    }
 
-        // iterate through until we either reach the end or find a new tile
-        while (i < bit_end && make_tile_string(bit_start + (sign * i), width, tile_size) == tile_string)
-        {
-            count++;
-            i += bit_step;
-        }
+    levels[0].count = (int)base_ids.size();
 
-        // only if we have at least three repeated tiles should we bother encoding as a run
-        if (count > 2)
-        {
-            // if we had a mishmash before encountering this run make sure we put that into the final first
-            if (!running_tiles.empty())
-            {
-                final_values.push_back((char)0x80 + running_tiles.size());
-                final_values.insert(final_values.end(), running_tiles.begin(), running_tiles.end());
-            }
+    for (size_t i = 1; i < sizes.size(); i++)
+    {
+        SizeLevel level;
+        level.size = sizes[i];
 
-            // a run can only be so long
-            if (count > 0x7F)
+        // Build from the biggest size we already have that goes evenly into this one
+        const SizeLevel* from = &levels[0];
+        for (auto& candidate : levels)
+        {
+            if (!candidate.ids.empty() && level.size % candidate.size == 0)
             {
-                while (count > 0x7F)
-                {
-                    final_values.push_back(0x7F);
-                    final_values.push_back(metatile_codes.at(tile_string));
-                    count -= 0x7F;
-                }
+                from = &candidate;
             }
-
-            // encode the run and reset our state
-            final_values.push_back((char)count);
-            final_values.push_back(metatile_codes.at(tile_string));
-            running_tiles.clear();
         }
-        else // need to collect the random tiles that will be literals
+
+        int factor = level.size / from->size;
+        if (from->width % factor == 0 && from->height % factor == 0)
         {
-            // intialize the literals
-            if (running_tiles.empty())
-            {
-                // will only ever be 1 or 2
-                for (int j = last; j < i; j += bit_step)
-                {
-                    string temp_tile_string = make_tile_string(bit_start + (sign * j), width, tile_size);
-                    running_tiles.push_back(metatile_codes.at(temp_tile_string));
-                }
-            }
-            else // already had a collection of literals
-            {
-                // if our size is too big then we need to flush and start a new segment
-                if (running_tiles.size() > 0xFC - 0x80)
-                {
-                    final_values.push_back((char)0x80 + running_tiles.size());
-                    final_values.insert(final_values.end(), running_tiles.begin(), running_tiles.end());
-                    running_tiles.clear();
-                }
-                else
-                {
-                    // will only ever be 1 or 2
-                    for (int j = last; j < i; j += bit_step)
-                    {
-                        string temp_tile_string = make_tile_string(bit_start + (sign * j), width, tile_size);
-                        running_tiles.push_back(metatile_codes.at(temp_tile_string));
-                    }
-                }
-            }
+            level.width = from->width / factor;
+            level.height = from->height / factor;
+            level.ids = intern_blocks(from->ids, from->width, from->height, factor, level.count);
         }
+
+        levels.push_back(move(level));
     }
 
-    // get any leftover unencoded stuff
-    if (!running_tiles.empty())
+    struct SizeReport
     {
-        final_values.push_back((char)0x80 + running_tiles.size());
-        final_values.insert(final_values.end(), running_tiles.begin(), running_tiles.end());
-    }
+        int code_width = 0;
+        size_t horizontal = 0;
+        size_t vertical = 0;
+        size_t tile_data = 0;
+    };
 
-    // terminate the string
-    final_values.push_back((char)0xFF);
+    int base_code_bytes = levels[0].count > 256 ? 2 : 1;
+    size_t chr_bytes = (size_t)base_size * base_size * (settings.depth ? settings.depth : 2) / 8;
+    vector<SizeReport> reports(levels.size());
+    parallel_for(levels.size(), [&](size_t i) {
+        const SizeLevel& level = levels[i];
+        SizeReport& report = reports[i];
+        if (level.ids.empty() || level.count > 1 << 16)
+        {
+            return;
+        }
 
-    vector<string> converted_values;
-    chars_to_hex(final_values, converted_values);
+        report.code_width = level.count > 256 ? 16 : 8;
+        TileGrid grid{ level.width, level.height, vector<TileCode>(level.ids.begin(), level.ids.end()) };
+        for (int y = 0; y < grid.height; y++)
+        {
+            report.horizontal += encoded_size(grid.row(y), report.code_width);
+        }
 
-    stringstream ss;
-    for_each(converted_values.begin(), converted_values.end(), [&ss](string& s) { ss << s << ", "; });
-    string retval = ss.str();
-    // erase trailing ", "
-    retval.pop_back();
-    retval.pop_back();
+        for (int x = 0; x < grid.width; x++)
+        {
+            report.vertical += encoded_size(grid.column(x), report.code_width);
+        }
 
-    return retval;
-}
+        // Base tiles at their CHR size, whatever they take in memory, plus a dictionary of base codes for bigger sizes
+        int per_tile = (level.size / base_size) * (level.size / base_size);
+        report.tile_data = (size_t)levels[0].count * chr_bytes + (i ? (size_t)level.count * per_tile * base_code_bytes : 0);
+    });
 
-void print_usage(const cxxopts::Options& options)
-{
-    cout << options.help() << endl;
+    cout << setw(6) << "Size" << setw(8) << "Tiles" << setw(6) << "Bits" << setw(12) << "Horizontal" << setw(10) << "Vertical" << setw(11) << "Tile data" << setw(15) << "Estimated ROM" << endl;
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        const SizeLevel& level = levels[i];
+        const SizeReport& report = reports[i];
+        cout << setw(6) << level.size;
+        if (level.ids.empty())
+        {
+            cout << "  doesn't divide the map evenly" << endl;
+        }
+        else if (!report.code_width)
+        {
+            cout << setw(8) << level.count << "  too many tiles for 16 bit codes" << endl;
+        }
+        else
+        {
+            cout << setw(8) << level.count << setw(6) << report.code_width << setw(12) << report.horizontal << setw(10) << report.vertical;
+            cout << setw(11) << report.tile_data << setw(15) << report.tile_data + min(report.horizontal, report.vertical) << endl;
+        }
+    }
+
+    return true;
 }
 
-bool validate_args(const cxxopts::ParseResult& result, string& map_name, string& output_base, int& tile_size, string& file_of_mappings)
+void print_offset(const string& label, const OffsetScore& score)
 {
-    map_name = result["map"].as<string>();
-    if (map_name.empty())
+    cout << label << " (" << score.offset_x << ", " << score.offset_y << "): " << score.tiles << " tiles in a " << score.columns << "x" << score.rows << " grid, ";
+    if (score.bytes)
     {
-        cout << "No map provided" << endl;
-        return false;
+        cout << score.bytes << " bytes encoded";
     }
-
-    output_base = result["output"].as<string>();
-    if (output_base.empty())
+    else
     {
-        cout << "Empty output provided" << endl;
+        cout << "too many tiles to encode";
     }
 
-    tile_size = result["tileSize"].as<int>();
-    if (tile_size < 8)
+    if (score.dropped)
     {
-        cout << "Tile size must be at least 8 pixels" << endl;
-        return false;
+        cout << ", " << score.dropped << " pixels dropped";
     }
 
-    file_of_mappings = result["fileOfMappings"].as<string>();
-
-    return true;
+    cout << endl;
 }
 
-void populate_metatile_codes(const string& mapping_file, int metatile_size, map<string, char>& metatile_codes)
+/*
+* Report the offsets with the fewest tiles and the smallest encoding without encoding the map
+*/
+bool find_offset(const EncoderSettings& settings)
 {
-    fstream file(mapping_file, ios::in);
-    if (!file.is_open() || !file.good())
+    shared_ptr<CBitmap> bitmap;
+    if (!load_map(settings.map_name, 0, bitmap))
     {
-        cout << "Couldn't open " << mapping_file << endl;
-        exit(1);
+        return false;
     }
 
-    int upper_left = (metatile_size - 1) * metatile_size;
-    string line;
-    while (getline(file, line))
+    vector<OffsetScore> scores = score_offsets(*bitmap, settings.metatile_size);
+    if (scores.empty())
     {
-        auto pos = line.find(',');
-        string bitmap_filename = line.substr(0, pos);
-        char code = stoi(line.substr(pos + 1));
-
-        CBitmap bitmap;
-        if (!bitmap.Load((bitmap_filename.c_str())))
-        {
-            cout << "Bitmap " << bitmap_filename << " not found" << endl;
-            exit(1);
-        }
+        cout << "Map is smaller than a tile" << endl;
+        return false;
+    }
 
-        if (bitmap.GetWidth() != metatile_size || bitmap.GetHeight() != metatile_size)
-        {
-            cout << "Bitmap " << bitmap_filename << " must be the tile size" << endl;
-            exit(1);
-        }
+    auto fewest = min_element(scores.begin(), scores.end(), [](const OffsetScore& a, const OffsetScore& b) {
+        return make_tuple(whole_map(a.tiles, a), a.dropped, a.bytes) < make_tuple(whole_map(b.tiles, b), b.dropped, b.bytes);
+    });
 
-        RGBA* bits = (RGBA*)bitmap.GetBits();
-        string tile_string = make_tile_string(bits + upper_left, metatile_size, metatile_size);
-        metatile_codes[tile_string] = code;
+    print_offset("No offset", scores[0]);
+    print_offset("Fewest tiles at", *fewest);
+    const OffsetScore* smallest = best_offset(scores, 16);
+    if (smallest)
+    {
+        print_offset("Smallest encoding at", *smallest);
     }
+
+    return true;
 }
 
 int main(int argc, char** argv)
 {
     cxxopts::Options options("RLE Encoder", "Utility to RLE encode a bitmap using the Konami algorithm");
     options.add_options()
-        ("m,map", "Map to parse and encode", cxxopts::value<string>()->default_value(""))
-        ("o,output", "Base name for output files (default: out)", cxxopts::value<string>()->default_value("out"))
+        ("m,map", "Map to parse and encode, or - to read it from stdin", cxxopts::value<string>()->default_value(""))
+        ("o,output", "Base name for output files, or - to write them all to stdout as one binary stream (default: out)", cxxopts::value<string>()->default_value("out"))
         ("t,tileSize", "Size of tiles to RLE encode (default: 16", cxxopts::value<int>()->default_value("16"))
         ("f,fileOfMappings", "A file that is comma separated bitmap,code separated by newlines. Code should be decimal. (optional)", cxxopts::value<string>()->default_value(""))
+        ("d,depth", "Pack tiles to 2 or 4 bits per pixel of palette indices; fails if a tile has too many colors (optional)", cxxopts::value<int>()->default_value("0"))
+        ("flips", "Treat tiles that are mirrors of each other as the same tile and output the flip bits for each tile")
+        ("relativePalettes", "Treat tiles that only differ by palette as the same tile and output the palette for each tile")
+        ("split", "Split maps with more than 256 tiles into screen aligned regions, each with its own bank of tiles on top of a shared base bank")
+        ("chunkScreens", "Also encode each screen on its own with an index of where each screen's data starts, so a single screen can be decoded; identical screens share their data")
+        ("screenOrientation", "Store each screen by rows or by columns, whichever is smaller (size) or decodes faster (cycles), with an orientation per screen; implies chunkScreens (optional)", cxxopts::value<string>()->default_value(""))
+        ("screenWidth", "Width of a screen in pixels (default: 256)", cxxopts::value<int>()->default_value("256"))
+        ("screenHeight", "Height of a screen in pixels (default: 240)", cxxopts::value<int>()->default_value("240"))
+        ("codeWidth", "Bits per tile code, 8 or 16; 16 bit codes use 16 bit run and literal headers too (default: 8)", cxxopts::value<int>()->default_value("8"))
+        ("codeOrder", "Order generated codes are handed out in: sorted by tile, or frequency to give the most used tiles the lowest codes (default: sorted)", cxxopts::value<string>()->default_value("sorted"))
+        ("maxTiles", "Lossily merge the tiles that differ by the fewest pixels until there are no more than this many, and output each merge (optional)", cxxopts::value<int>()->default_value("0"))
+        ("levels", "Build this many levels of metatiles, each made of 2x2 of the level below, e.g. -t 8 --levels 3 for 8x8 tiles, 16x16 metatiles and 32x32 blocks; strips encode the top level (default: 1)", cxxopts::value<int>()->default_value("1"))
+        ("evaluateSizes", "Instead of encoding, report tile counts and encoded sizes at each of these comma separated tile sizes, e.g. 8,16,32 (optional)", cxxopts::value<vector<int>>())
+        ("offset", "Start the tile grid this many pixels right and down from the upper left, as dx,dy, or auto to pick the offset with the smallest encoding; pixels past the last whole tile are dropped (optional)", cxxopts::value<string>()->default_value(""))
+        ("quantize", "Snap every pixel to the nearest of these comma separated RRGGBB colors, or auto for four colors found by k-means clustering of the map's colors weighted by use, before finding tiles; fails if a 16x16 attribute area ends up with more than 4 colors (optional)", cxxopts::value<string>()->default_value(""))
+        ("attributes", "Work out NES attributes from the colors of each 16x16 area, with up to 4 palettes sharing the most used color, and encode them a byte per 32x32 block with an index of where each strip starts")
+        ("layers", "Also encode these bitmaps, lined up with the map, as layers in the same pass, e.g. collision=col.bmp,objects=obj.bmp, and write every layer into one binary per orientation (optional)", cxxopts::value<vector<string>>())
+        ("frames", "Later frames of an animated map, e.g. water1.bmp,water2.bmp, that share the map's tiles and are each coded as the tiles that changed from the frame before (optional)", cxxopts::value<vector<string>>())
+        ("layerCodes", "Give each layer its own tiles and codes (separate) or share one dictionary between the map and every layer (combined) (default: separate)", cxxopts::value<string>()->default_value("separate"))
+        ("findOffset", "Instead of encoding, try every offset of the tile grid within a tile and report the ones with the fewest tiles and the smallest encoding, counting pixels past the last whole tile as if they tiled like the rest")
+        ("codec", "How strips are coded: konami RLE, delta to code each strip as copies from the one before it plus literal patches, or nibble to pack codes two to a byte when there are no more than 16 (default: konami)", cxxopts::value<string>()->default_value("konami"))
+        ("cycleCosts", "6502 cycles the decoder takes per header, literal, run repeat and end of stream, and optionally per nibble packed byte (default: 22,16,9,12)", cxxopts::value<vector<int>>()->default_value("22,16,9,12"))
+        ("cycleReport", "Output the bytes and decode cycles of each strip of the map")
+        ("optimize", "Pick runs and literals for the smallest encoding overall instead of greedily, counting cycleWeight bytes per decode cycle")
+        ("cycleWeight", "Bytes a decode cycle is worth to the optimal encoder (default: 0)", cxxopts::value<double>()->default_value("0"))
+        ("cycleBudget", "Most cycles a strip should take to decode; the optimal encoder trades bytes for cycles on strips over it (optional)", cxxopts::value<int>()->default_value("0"))
+        ("entropy", "Also Huffman code each orientation with a table built for this map, from the codec's tokens or the raw tiles, into a binary file (optional)", cxxopts::value<string>()->default_value(""))
+        ("benchmark", "Report Huffman encode and decode throughput in MB/s; needs entropy")
+        ("w,watch", "Stay running and re-encode whenever the map or mappings change")
+        ("c,cache", "Directory to cache encoded strips in, can be shared between runs (optional)", cxxopts::value<string>()->default_value(""))
+        ("cacheLimit", "Size in MB to trim the strip cache down to, least recently used first (default: 64)", cxxopts::value<int>()->default_value("64"))
         ("h,help", "Print usage")
         ;
 
-    string map_name;
-    string output_base;
-    int metatile_size;
-    string file_of_mappings;
+    EncoderSettings settings;
+    streambuf* stdout_buffer = cout.rdbuf();
     try
     {
         auto result = options.parse(argc, argv);
@@ -298,7 +4446,13 @@ int main(int argc, char** argv)
             exit(0);
         }
 
-        if (!validate_args(result, map_name, output_base, metatile_size, file_of_mappings))
+        // Streaming the outputs leaves stdout to them alone, so everything we'd print goes to stderr instead
+        if (result["output"].as<string>() == "-")
+        {
+            cout.rdbuf(cerr.rdbuf());
+        }
+
+        if (!validate_args(result, settings))
         {
             print_usage(options);
             exit(1);
@@ -310,97 +4464,46 @@ int main(int argc, char** argv)
         exit(0);
     }
 
-    CBitmap bitmap;
-    if (!bitmap.Load((map_name.c_str())))
-    {
-        cout << "Bitmap " << map_name << " not found" << endl;
-        exit(1);
-    }
-
-    if (bitmap.GetHeight() % metatile_size || bitmap.GetWidth() % metatile_size)
+    if (!settings.evaluate_sizes.empty())
     {
-        cout << "Bitmap " << map_name << " dimensions must be evenly divisible by the tile size" << endl;
-        exit(1);
+        exit(evaluate_sizes(settings) ? 0 : 1);
     }
 
-    map<string, char> metatile_codes;
-    if (!file_of_mappings.empty())
+    if (settings.find_offset)
     {
-        populate_metatile_codes(file_of_mappings, metatile_size, metatile_codes);
+        exit(find_offset(settings) ? 0 : 1);
     }
 
-    RGBA* bits = (RGBA*)bitmap.GetBits();
-
-    // Bitmaps index from the lower left, but we want to output index from the upper left
-    int upper_left = (bitmap.GetHeight() - 1) * bitmap.GetWidth();
-
-    // If we weren't provided metatile code mappings calculate it ourselves
-    if (metatile_codes.empty())
+    EncoderState state;
+    if (!update_state(settings, state, true, true))
     {
-        set<string> metatiles;
-        // Figure out what our metatiles are for final output
-        // TODO: give caller the option to pass in a file that maps metatile bitmaps to their code and use that to
-        // generate the metatile_codes map; would let us skip this for loop and the next one and give us control
-        // over how things are encoded; especially important for attribute tables but also nice if you want your
-        // metatiles to have some order to them, rather than the arbitrary order we get by generating it from the map.
-        // But still leave in this method because it could be useful (hell, even if it's to do a first pass and create the
-        // metatiles before then giving them your own codes and re-encoding the map)
-        for (int i = upper_left; i >= 0; i -= metatile_size * bitmap.GetWidth())
-        {
-            for (int j = i; j < bitmap.GetWidth() + i; j += metatile_size)
-            {
-                string tile_string = make_tile_string(bits + j, bitmap.GetWidth(), metatile_size);
-                metatiles.insert(tile_string);
-            }
-        }
-
-        if (metatiles.size() > 256)
-        {
-            cout << "Too many metatiles generated at provided tile size: " << metatiles.size() << endl;
-            exit(1);
-        }
-
-        char code = 0;
-        for (auto metatile : metatiles)
-        {
-            metatile_codes[metatile] = code;
-            code++;
-        }
+        exit(1);
     }
 
-    vector<string> horizontal_codings;
-    // Encode horizontal strips
-    for (int i = upper_left; i >= 0; i -= metatile_size * bitmap.GetWidth())
+    // Watching always keeps strips in memory, so a save only re-encodes the strips it changed
+    unique_ptr<StripCache> cache;
+    if (!settings.cache_directory.empty() || settings.watch)
     {
-        horizontal_codings.push_back(rle_encode(bits + i, bitmap.GetWidth(), metatile_size, metatile_codes));
+        cache.reset(new StripCache(settings.cache_directory, (uintmax_t)settings.cache_limit * 1024 * 1024));
     }
 
-    vector<string> vertical_codings;
-    // Encode vertical strips
-    for (int i = upper_left; i < bitmap.GetWidth() + upper_left; i += metatile_size)
-    {
-        vertical_codings.push_back(rle_encode(bits + i, bitmap.GetWidth(), metatile_size, metatile_codes, bitmap.GetHeight()));
-    }
+    encode_state(settings, state, cache.get());
 
-    ofstream output;
-    output.open(output_base + "-horizontal.txt");
-    for (auto& coding : horizontal_codings)
+    if (settings.output_base == "-")
     {
-        output << coding << endl;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        ostream container(stdout_buffer);
+        write_container(state, settings.metatile_size, container);
     }
-
-    output.close();
-
-    output.open(output_base + "-vertical.txt");
-    for (auto& coding : vertical_codings)
+    else
     {
-        output << coding << endl;
+        write_outputs(state, nullptr, settings.metatile_size, settings.output_base);
     }
 
-    output.close();
-
-    for (auto& entry : metatile_codes)
+    if (settings.watch)
     {
-        output_bitmap(entry.first, entry.second, metatile_size, output_base);
+        watch_inputs(settings, state, cache.get());
     }
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/*
+* A tile's code in the map.  Wide enough for either code width; codes only get narrowed to the output width when strips
+* are encoded.
+*/
+typedef std::uint16_t TileCode;
+
+/*
+* The map as a grid of tile codes, indexed from the upper left.  Everything downstream of tile identification works
+* off of this instead of going back to the pixels.
+*/
+struct TileGrid
+{
+    int width = 0;  // in tiles
+    int height = 0; // in tiles
+    std::vector<TileCode> codes;
+
+    std::vector<TileCode> row(int y) const;
+    std::vector<TileCode> column(int x) const;
+};
+
+/*
+* Run body(i) for every i in [0, count) across all the cores we have.  Iterations have to be independent.
+*/
+inline void parallel_for(size_t count, const std::function<void(size_t)>& body)
+{
+    size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+    if (thread_count <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            body(i);
+        }
+
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; t++)
+    {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                body(i);
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include "RegionSplitter.h"
+#include "RLEEncoder.h"
+
+using namespace std;
+
+namespace
+{
+    /*
+    * The greedy partition for one choice of base bank.  Growing a region from its first screen until the next screen
+    * won't fit gives the fewest regions, so all that needs searching is how far each possible split line can reach.
+    */
+    bool partition_with_base(const vector<vector<int>>& screen_tiles, int tile_count, const vector<int>& base_tiles, int max_codes, RegionPartition& partition)
+    {
+        int screens = (int)screen_tiles.size();
+        int local_limit = max_codes - (int)base_tiles.size();
+
+        vector<bool> in_base(tile_count, false);
+        for (int tile : base_tiles)
+        {
+            in_base[tile] = true;
+        }
+
+        // Every candidate split line is independent, so find how far each one reaches in parallel
+        vector<int> reach(screens, -1);
+        parallel_for(screens, [&](size_t start) {
+            vector<bool> used(tile_count, false);
+            int local = 0;
+            int end = (int)start;
+            while (end < screens)
+            {
+                int added = 0;
+                for (int tile : screen_tiles[end])
+                {
+                    added += !in_base[tile] && !used[tile];
+                }
+
+                if (local + added > local_limit)
+                {
+                    break;
+                }
+
+                for (int tile : screen_tiles[end])
+                {
+                    used[tile] = true;
+                }
+
+                local += added;
+                end++;
+            }
+
+            reach[start] = end;
+        });
+
+        partition.base_tiles = base_tiles;
+        partition.regions.clear();
+        for (int start = 0; start < screens; start = reach[start])
+        {
+            if (reach[start] == start)
+            {
+                return false;
+            }
+
+            Region region;
+            region.start = start;
+            region.end = reach[start];
+
+            set<int> local;
+            for (int screen = region.start; screen < region.end; screen++)
+            {
+                for (int tile : screen_tiles[screen])
+                {
+                    if (!in_base[tile])
+                    {
+                        local.insert(tile);
+                    }
+                }
+            }
+
+            region.local_tiles.assign(local.begin(), local.end());
+            partition.regions.push_back(region);
+        }
+
+        return true;
+    }
+}
+
+bool split_regions(const vector<int>& ids, int width, int height, int screen_size, bool split_columns, int max_codes, RegionPartition& partition)
+{
+    int length = split_columns ? width : height;
+    int screens = (length + screen_size - 1) / screen_size;
+    int tile_count = ids.empty() ? 0 : *max_element(ids.begin(), ids.end()) + 1;
+
+    // The distinct tiles in each screen
+    vector<vector<int>> screen_tiles(screens);
+    for (int screen = 0; screen < screens; screen++)
+    {
+        set<int> tiles;
+        for (int i = screen * screen_size; i < min(length, (screen + 1) * screen_size); i++)
+        {
+            for (int j = 0; j < (split_columns ? height : width); j++)
+            {
+                tiles.insert(split_columns ? ids[j * width + i] : ids[i * width + j]);
+            }
+        }
+
+        if ((int)tiles.size() > max_codes)
+        {
+            cout << "Screen " << screen << " uses " << tiles.size() << " tiles on its own, more than the " << max_codes << " a region can hold" << endl;
+            return false;
+        }
+
+        screen_tiles[screen].assign(tiles.begin(), tiles.end());
+    }
+
+    // Base bank candidates are the tiles shared by the most screens
+    vector<int> screen_counts(tile_count, 0);
+    for (auto& tiles : screen_tiles)
+    {
+        for (int tile : tiles)
+        {
+            screen_counts[tile]++;
+        }
+    }
+
+    vector<int> shared;
+    for (int tile = 0; tile < tile_count; tile++)
+    {
+        if (screen_counts[tile] > 1)
+        {
+            shared.push_back(tile);
+        }
+    }
+
+    stable_sort(shared.begin(), shared.end(), [&](int a, int b) { return screen_counts[a] > screen_counts[b]; });
+
+    // Try base banks of increasing size and keep whichever needs the fewest regions, then the fewest tiles overall
+    vector<size_t> base_sizes;
+    size_t largest = min(shared.size(), (size_t)max_codes - 1);
+    for (size_t base_size = 0; base_size < largest; base_size += 8)
+    {
+        base_sizes.push_back(base_size);
+    }
+
+    base_sizes.push_back(largest);
+
+    bool found = false;
+    size_t best_total = 0;
+    for (size_t base_size : base_sizes)
+    {
+        vector<int> base(shared.begin(), shared.begin() + base_size);
+        RegionPartition candidate;
+        if (!partition_with_base(screen_tiles, tile_count, base, max_codes, candidate))
+        {
+            continue;
+        }
+
+        size_t total = base.size();
+        for (auto& region : candidate.regions)
+        {
+            total += region.local_tiles.size();
+        }
+
+        if (!found || candidate.regions.size() < partition.regions.size() ||
+            (candidate.regions.size() == partition.regions.size() && total < best_total))
+        {
+            partition = candidate;
+            best_total = total;
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        cout << "Couldn't split the map into regions that fit in " << max_codes << " tiles" << endl;
+    }
+
+    return found;
+}
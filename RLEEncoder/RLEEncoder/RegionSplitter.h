@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+/*
+* A run of whole screens that gets its own tile bank.  Screens are counted along whichever axis the map is split on.
+*/
+struct Region
+{
+    int start = 0; // first screen
+    int end = 0;   // one past the last screen
+    std::vector<int> local_tiles; // tiles this region needs that aren't in the base bank
+};
+
+struct RegionPartition
+{
+    std::vector<int> base_tiles; // tiles every region shares
+    std::vector<Region> regions;
+};
+
+/*
+* Split a map whose tiles don't fit in max_codes into screen aligned regions that each do, with the tiles that show up
+* across the most screens pulled into a base bank shared by every region.  ids is the map as tile IDs, upper left first,
+* and screen_size is how many tiles wide (split_columns) or tall a screen is.  Fails if a single screen can't fit.
+*/
+bool split_regions(const std::vector<int>& ids, int width, int height, int screen_size, bool split_columns, int max_codes, RegionPartition& partition);
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include "StripCache.h"
+
+using namespace std;
+
+namespace
+{
+    /*
+    * Entries are laid out as: codec length, codec, strip length, strip, encoded length, encoded
+    */
+    void write_block(ofstream& file, const char* data, uint32_t length)
+    {
+        file.write((const char*)&length, sizeof(length));
+        file.write(data, length);
+    }
+
+    bool read_block(ifstream& file, string& block)
+    {
+        uint32_t length = 0;
+        if (!file.read((char*)&length, sizeof(length)))
+        {
+            return false;
+        }
+
+        block.resize(length);
+        return length == 0 || (bool)file.read(&block[0], length);
+    }
+
+    /*
+    * 64-bit FNV-1a; plenty to spread entries out and collisions are caught by comparing the stored strip
+    */
+    uint64_t hash_bytes(uint64_t hash, const char* data, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            hash ^= (uint8_t)data[i];
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+}
+
+StripCache::StripCache(const string& directory, uintmax_t max_bytes) : m_directory(directory), m_max_bytes(max_bytes)
+{
+    if (!m_directory.empty())
+    {
+        error_code ec;
+        filesystem::create_directories(m_directory, ec);
+    }
+}
+
+string StripCache::memory_key(const string& codec, const vector<char>& strip)
+{
+    string key = codec;
+    key.push_back('\0');
+    key.append(strip.begin(), strip.end());
+    return key;
+}
+
+string StripCache::entry_path(const string& codec, const vector<char>& strip) const
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hash = hash_bytes(hash, codec.c_str(), codec.size() + 1); // include the terminator so codec and strip can't run together
+    hash = hash_bytes(hash, strip.data(), strip.size());
+
+    stringstream ss;
+    ss << setfill('0') << setw(16) << hex << hash << ".strip";
+    return (filesystem::path(m_directory) / ss.str()).string();
+}
+
+bool StripCache::lookup(const string& codec, const vector<char>& strip, vector<char>& encoded)
+{
+    string key = memory_key(codec, strip);
+    {
+        lock_guard<mutex> lock(m_memory_mutex);
+        auto found = m_memory.find(key);
+        if (found != m_memory.end())
+        {
+            found->second.used = true;
+            encoded = found->second.encoded;
+            return true;
+        }
+    }
+
+    if (m_directory.empty())
+    {
+        return false;
+    }
+
+    string path = entry_path(codec, strip);
+    ifstream file(path, ios::in | ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    string stored_codec;
+    string stored_strip;
+    string stored_encoded;
+    if (!read_block(file, stored_codec) || !read_block(file, stored_strip) || !read_block(file, stored_encoded))
+    {
+        return false;
+    }
+
+    if (stored_codec != codec || stored_strip.size() != strip.size() || !equal(strip.begin(), strip.end(), stored_strip.begin()))
+    {
+        return false;
+    }
+
+    file.close();
+
+    // Touching the entry is what keeps it from being evicted
+    error_code ec;
+    filesystem::last_write_time(path, filesystem::file_time_type::clock::now(), ec);
+
+    encoded.assign(stored_encoded.begin(), stored_encoded.end());
+
+    lock_guard<mutex> lock(m_memory_mutex);
+    m_memory[key] = MemoryEntry{ encoded, true };
+    return true;
+}
+
+void StripCache::store(const string& codec, const vector<char>& strip, const vector<char>& encoded)
+{
+    {
+        lock_guard<mutex> lock(m_memory_mutex);
+        m_memory[memory_key(codec, strip)] = MemoryEntry{ encoded, true };
+    }
+
+    if (m_directory.empty())
+    {
+        return;
+    }
+
+    static thread_local mt19937_64 generator(random_device{}());
+
+    string path = entry_path(codec, strip);
+    stringstream ss;
+    ss << path << "." << hex << generator() << ".tmp";
+    string temp_path = ss.str();
+
+    {
+        ofstream file(temp_path, ios::out | ios::binary);
+        if (!file.is_open())
+        {
+            return;
+        }
+
+        write_block(file, codec.c_str(), codec.size());
+        write_block(file, strip.data(), strip.size());
+        write_block(file, encoded.data(), encoded.size());
+        if (!file.good())
+        {
+            file.close();
+            error_code ec;
+            filesystem::remove(temp_path, ec);
+            return;
+        }
+    }
+
+    // If another worker beat us to it the rename can fail on some platforms, but then the entry is already there
+    error_code ec;
+    filesystem::rename(temp_path, path, ec);
+    if (ec)
+    {
+        filesystem::remove(temp_path, ec);
+    }
+}
+
+void StripCache::trim()
+{
+    {
+        lock_guard<mutex> lock(m_memory_mutex);
+        for (auto entry = m_memory.begin(); entry != m_memory.end();)
+        {
+            if (entry->second.used)
+            {
+                entry->second.used = false;
+                entry++;
+            }
+            else
+            {
+                entry = m_memory.erase(entry);
+            }
+        }
+    }
+
+    if (m_directory.empty())
+    {
+        return;
+    }
+
+    struct Entry
+    {
+        filesystem::path path;
+        filesystem::file_time_type time;
+        uintmax_t size;
+    };
+
+    vector<Entry> entries;
+    vector<Entry> temps;
+    uintmax_t total = 0;
+    filesystem::file_time_type newest = filesystem::file_time_type::min();
+    error_code ec;
+    for (auto& item : filesystem::directory_iterator(m_directory, ec))
+    {
+        bool temp = item.path().extension() == ".tmp";
+        if (!temp && item.path().extension() != ".strip")
+        {
+            continue;
+        }
+
+        error_code item_ec;
+        Entry entry{ item.path(), item.last_write_time(item_ec), item.file_size(item_ec) };
+        if (item_ec)
+        {
+            // Someone else evicted it out from under us
+            continue;
+        }
+
+        if (temp)
+        {
+            temps.push_back(entry);
+            continue;
+        }
+
+        newest = max(newest, entry.time);
+        total += entry.size;
+        entries.push_back(entry);
+    }
+
+    // A temporary file older than the newest entry was left by a writer that died before renaming it.  If a slow
+    // writer does lose its file here, its rename just fails and the strip isn't stored
+    for (auto& temp : temps)
+    {
+        if (temp.time < newest)
+        {
+            filesystem::remove(temp.path, ec);
+        }
+    }
+
+    if (total <= m_max_bytes)
+    {
+        return;
+    }
+
+    sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+    for (auto& entry : entries)
+    {
+        if (total <= m_max_bytes)
+        {
+            break;
+        }
+
+        // Failing to remove is fine, another worker is trimming too
+        filesystem::remove(entry.path, ec);
+        total -= entry.size;
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+* An on-disk, content-addressed cache of encoded strips.  Entries are keyed by a hash of the codec name and the strip's
+* tile codes, so identical strips from any map or any run share an entry.  Several encoders can point at the same
+* directory at once: entries are written to a temporary file and renamed into place, and anything that can't be read
+* back intact is treated as a miss.
+*
+* Entries are also kept in memory, in front of the directory, so a resident encoder can skip strips it encoded last
+* time round.  With no directory the cache lives only in memory.
+*/
+class StripCache
+{
+public:
+    StripCache(const std::string& directory, std::uintmax_t max_bytes);
+
+    bool lookup(const std::string& codec, const std::vector<char>& strip, std::vector<char>& encoded);
+    void store(const std::string& codec, const std::vector<char>& strip, const std::vector<char>& encoded);
+
+    // Evict least recently used entries until the cache fits in max_bytes, remove temporary files left by writers
+    // that died, and forget the entries in memory that haven't been used since the last trim
+    void trim();
+
+private:
+    struct MemoryEntry
+    {
+        std::vector<char> encoded;
+        bool used;
+    };
+
+    std::string entry_path(const std::string& codec, const std::vector<char>& strip) const;
+    static std::string memory_key(const std::string& codec, const std::vector<char>& strip);
+
+    std::string m_directory;
+    std::uintmax_t m_max_bytes;
+    std::mutex m_memory_mutex;
+    std::unordered_map<std::string, MemoryEntry> m_memory;
+};
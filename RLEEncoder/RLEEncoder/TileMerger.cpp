@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include "RLEEncoder.h"
+#include "TileMerger.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TILE_MERGER_SSE2
+#endif
+
+using namespace std;
+
+namespace
+{
+    const int bands = 8;     // independent hashes per tile; sharing a bucket in any of them makes two tiles candidates
+    const int neighbors = 16; // closest candidates kept per tile
+
+    struct Candidate
+    {
+        long long cost; // pixels changed across the map
+        int distance;
+        int from;
+        int into;
+        int from_uses; // uses when the cost was worked out, so a merge since then can be spotted
+        int into_uses;
+
+        bool operator>(const Candidate& other) const
+        {
+            if (cost != other.cost)
+            {
+                return cost > other.cost;
+            }
+
+            return from != other.from ? from > other.from : into > other.into;
+        }
+    };
+
+    Candidate make_candidate(int a, int b, int distance, const vector<int>& uses)
+    {
+        // Fold the less used tile into the more used one, the later one on a tie
+        int from = uses[a] < uses[b] || (uses[a] == uses[b] && a > b) ? a : b;
+        int into = from == a ? b : a;
+        return Candidate{ (long long)distance * uses[from], distance, from, into, uses[from], uses[into] };
+    }
+
+    /*
+    * Bit sampling LSH: each band hashes the same few pixel positions of every tile, so tiles that differ in few pixels
+    * are likely to land in the same bucket in at least one band.  With no samples everything is one bucket.
+    */
+    vector<vector<int>> candidate_buckets(const vector<vector<uint32_t>>& pixels, const vector<int>& live, int samples, vector<vector<int>>& tile_buckets)
+    {
+        vector<vector<int>> buckets;
+        tile_buckets.assign(pixels.size(), vector<int>());
+        if (samples == 0)
+        {
+            buckets.push_back(live);
+            for (int tile : live)
+            {
+                tile_buckets[tile].push_back(0);
+            }
+
+            return buckets;
+        }
+
+        vector<int> positions(pixels[0].size());
+        iota(positions.begin(), positions.end(), 0);
+        mt19937 generator(samples);
+        for (int band = 0; band < bands; band++)
+        {
+            shuffle(positions.begin(), positions.end(), generator);
+            unordered_map<uint64_t, int> band_buckets;
+            for (int tile : live)
+            {
+                uint64_t hash = 14695981039346656037ull;
+                for (int s = 0; s < samples; s++)
+                {
+                    hash = (hash ^ pixels[tile][positions[s]]) * 1099511628211ull;
+                }
+
+                auto found = band_buckets.emplace(hash, (int)buckets.size());
+                if (found.second)
+                {
+                    buckets.push_back(vector<int>());
+                }
+
+                buckets[found.first->second].push_back(tile);
+                tile_buckets[tile].push_back(found.first->second);
+            }
+        }
+
+        return buckets;
+    }
+}
+
+int pixel_distance(const uint32_t* a, const uint32_t* b, size_t count)
+{
+    size_t i = 0;
+    int same = 0;
+#ifdef TILE_MERGER_SSE2
+    // Four pixels at a time; lanes that match compare to -1, so subtracting counts them
+    __m128i matches = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        matches = _mm_sub_epi32(matches, equal);
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, matches);
+    same = (int)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+#endif
+    for (; i < count; i++)
+    {
+        same += a[i] == b[i];
+    }
+
+    return (int)count - same;
+}
+
+vector<int> merge_tiles(const vector<vector<uint32_t>>& pixels, const vector<int>& tile_uses, size_t max_tiles)
+{
+    vector<int> into(pixels.size());
+    iota(into.begin(), into.end(), 0);
+    if (pixels.size() <= max_tiles || pixels.empty())
+    {
+        return into;
+    }
+
+    vector<int> uses = tile_uses;
+    size_t live_count = pixels.size();
+    size_t pixel_count = pixels[0].size();
+
+    // Start out hashing a sixteenth of the pixels, and sample fewer each time merges run out until everything's compared
+    for (int samples = max(1, (int)pixel_count / 16); live_count > max_tiles; samples /= 2)
+    {
+        size_t live_before = live_count;
+        vector<int> live;
+        for (size_t tile = 0; tile < pixels.size(); tile++)
+        {
+            if (into[tile] == (int)tile)
+            {
+                live.push_back((int)tile);
+            }
+        }
+
+        vector<vector<int>> tile_buckets;
+        vector<vector<int>> buckets = candidate_buckets(pixels, live, samples, tile_buckets);
+
+        // Each tile's closest candidates, worked out independently
+        vector<vector<pair<int, int>>> nearest(pixels.size());
+        parallel_for(live.size(), [&](size_t i) {
+            int tile = live[i];
+            vector<int> mates;
+            for (int bucket : tile_buckets[tile])
+            {
+                mates.insert(mates.end(), buckets[bucket].begin(), buckets[bucket].end());
+            }
+
+            sort(mates.begin(), mates.end());
+            mates.erase(unique(mates.begin(), mates.end()), mates.end());
+
+            vector<pair<int, int>>& closest = nearest[tile]; // distance, tile
+            for (int mate : mates)
+            {
+                if (mate != tile)
+                {
+                    closest.push_back(make_pair(pixel_distance(pixels[tile].data(), pixels[mate].data(), pixel_count), mate));
+                }
+            }
+
+            size_t keep = min(closest.size(), (size_t)neighbors);
+            partial_sort(closest.begin(), closest.begin() + keep, closest.end());
+            closest.resize(keep);
+        });
+
+        priority_queue<Candidate, vector<Candidate>, greater<Candidate>> queue;
+        for (int tile : live)
+        {
+            for (auto& mate : nearest[tile])
+            {
+                queue.push(make_candidate(tile, mate.second, mate.first, uses));
+            }
+        }
+
+        while (!queue.empty() && live_count > max_tiles)
+        {
+            Candidate candidate = queue.top();
+            queue.pop();
+            if (into[candidate.from] != candidate.from || into[candidate.into] != candidate.into)
+            {
+                continue;
+            }
+
+            // Either tile may have picked up uses from an earlier merge, which changes the cost and maybe the direction
+            if (uses[candidate.from] != candidate.from_uses || uses[candidate.into] != candidate.into_uses)
+            {
+                queue.push(make_candidate(candidate.from, candidate.into, candidate.distance, uses));
+                continue;
+            }
+
+            into[candidate.from] = candidate.into;
+            uses[candidate.into] += uses[candidate.from];
+            live_count--;
+        }
+
+        // Comparing everything only keeps each tile's closest few, so it may take a few goes
+        if (samples == 0 && live_count == live_before)
+        {
+            break;
+        }
+    }
+
+    // Tiles merged into a tile that was later merged itself end up wherever that one did
+    for (size_t tile = 0; tile < into.size(); tile++)
+    {
+        int final_tile = into[tile];
+        while (into[final_tile] != final_tile)
+        {
+            final_tile = into[final_tile];
+        }
+
+        into[tile] = final_tile;
+    }
+
+    return into;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+* How many of count pixels differ between two tiles
+*/
+int pixel_distance(const std::uint32_t* a, const std::uint32_t* b, std::size_t count);
+
+/*
+* Lossily merge tiles into each other until no more than max_tiles are left.  pixels holds each distinct tile's pixels,
+* all the same size, and uses how many times it shows up in the map.  Of two tiles, the less used one is folded into the
+* other at a cost of the pixels that changes across the map, and the cheapest merge always goes next.  Only tiles that
+* locality-sensitive hashing puts near each other are compared, widening the search when they run out.  Returns the tile
+* each tile ends up as.
+*/
+std::vector<int> merge_tiles(const std::vector<std::vector<std::uint32_t>>& pixels, const std::vector<int>& uses, std::size_t max_tiles);
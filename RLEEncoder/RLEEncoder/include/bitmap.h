@@ -107,6 +107,9 @@ private:
 	BITMAP_HEADER m_BitmapHeader;
 	RGBA* m_BitmapData;
 	unsigned int m_BitmapSize;
+	uint8_t* m_IndexData;
+	BGRA* m_ColorTable;
+	unsigned int m_ColorTableSize;
 
 	// Masks and bit counts shouldn't exceed 32 Bits
 public:
@@ -150,11 +153,11 @@ public:
 
 public:
 
-	CBitmap() : m_BitmapData(0), m_BitmapSize(0) {
+	CBitmap() : m_BitmapData(0), m_BitmapSize(0), m_IndexData(0), m_ColorTable(0), m_ColorTableSize(0) {
 		Dispose();
 	}
 
-	CBitmap(const char* Filename) : m_BitmapData(0), m_BitmapSize(0) {
+	CBitmap(const char* Filename) : m_BitmapData(0), m_BitmapSize(0), m_IndexData(0), m_ColorTable(0), m_ColorTableSize(0) {
 		Load(Filename);
 	}
 
@@ -167,13 +170,24 @@ public:
 			delete[] m_BitmapData;
 			m_BitmapData = 0;
 		}
+		if (m_IndexData) {
+			delete[] m_IndexData;
+			m_IndexData = 0;
+		}
+		if (m_ColorTable) {
+			delete[] m_ColorTable;
+			m_ColorTable = 0;
+		}
+		m_ColorTableSize = 0;
 		memset(&m_BitmapFileHeader, 0, sizeof(m_BitmapFileHeader));
 		memset(&m_BitmapHeader, 0, sizeof(m_BitmapHeader));
 	}
 
-	/* Load specified Bitmap and stores it as RGBA in an internal buffer */
+	/* Load specified Bitmap and stores it as RGBA in an internal buffer.
+	 * If KeepIndices is set, 1, 4 and 8 bit images instead keep one palette index per pixel alongside their color table.
+	 */
 
-	bool Load(const char* Filename) {
+	bool Load(const char* Filename, bool KeepIndices = false) {
 		std::ifstream file(Filename, std::ios::binary | std::ios::in);
 
 		if (file.bad()) {
@@ -184,6 +198,13 @@ public:
 			return false;
 		}
 
+		return Load(file, KeepIndices);
+	}
+
+	/* Load from a stream that's already open in binary mode.  The stream has to be seekable, so read a pipe into memory first.
+	 */
+
+	bool Load(std::istream& file, bool KeepIndices = false) {
 		Dispose();
 
 		file.read((char*)&m_BitmapFileHeader, BITMAP_FILEHEADER_SIZE);
@@ -213,12 +234,24 @@ public:
 
 		BGRA* ColorTable = new BGRA[ColorTableSize]; // std::bad_alloc exception should be thrown if memory is not available
 
-		file.read((char*)ColorTable, sizeof(BGRA) * m_BitmapHeader.ClrUsed);
+		// A ClrUsed of zero means the table is full sized
+		unsigned int ColorsUsed = m_BitmapHeader.ClrUsed && m_BitmapHeader.ClrUsed < ColorTableSize ? m_BitmapHeader.ClrUsed : ColorTableSize;
+		memset(ColorTable, 0, sizeof(BGRA) * ColorTableSize);
+		file.read((char*)ColorTable, sizeof(BGRA) * ColorsUsed);
 
 		/* ... Color Table for 16 bits images are not supported yet */
 
 		m_BitmapSize = GetWidth() * GetHeight();
-		m_BitmapData = new RGBA[m_BitmapSize];
+
+		bool Indexed = KeepIndices && ColorTableSize > 0 && m_BitmapHeader.Compression <= 1;
+		if (Indexed) {
+			m_IndexData = new uint8_t[m_BitmapSize];
+			m_ColorTable = ColorTable;
+			m_ColorTableSize = ColorsUsed;
+		}
+		else {
+			m_BitmapData = new RGBA[m_BitmapSize];
+		}
 
 		unsigned int LineWidth = ((GetWidth() * GetBitCount() / 8) + 3) & ~3;
 		uint8_t* Line = new uint8_t[LineWidth];
@@ -237,7 +270,14 @@ public:
 				for (unsigned int j = 0; j < GetWidth(); j++) {
 					if (m_BitmapHeader.BitCount == 1) {
 						uint32_t Color = *((uint8_t*)LinePtr);
-						for (int k = 0; k < 8; k++) {
+						if (Indexed) {
+							for (int k = 0; k < 8; k++) {
+								m_IndexData[Index] = Color & 0x80 ? 1 : 0;
+								Index++;
+								Color <<= 1;
+							}
+						}
+						for (int k = 0; k < 8 && !Indexed; k++) {
 							m_BitmapData[Index].Red = ColorTable[Color & 0x80 ? 1 : 0].Red;
 							m_BitmapData[Index].Green = ColorTable[Color & 0x80 ? 1 : 0].Green;
 							m_BitmapData[Index].Blue = ColorTable[Color & 0x80 ? 1 : 0].Blue;
@@ -248,6 +288,15 @@ public:
 						LinePtr++;
 						j += 7;
 					}
+					else if (m_BitmapHeader.BitCount == 4 && Indexed) {
+						uint32_t Color = *((uint8_t*)LinePtr);
+						m_IndexData[Index] = (Color >> 4) & 0x0f;
+						Index++;
+						m_IndexData[Index] = Color & 0x0f;
+						Index++;
+						LinePtr++;
+						j++;
+					}
 					else if (m_BitmapHeader.BitCount == 4) {
 						uint32_t Color = *((uint8_t*)LinePtr);
 						m_BitmapData[Index].Red = ColorTable[(Color >> 4) & 0x0f].Red;
@@ -263,6 +312,11 @@ public:
 						LinePtr++;
 						j++;
 					}
+					else if (m_BitmapHeader.BitCount == 8 && Indexed) {
+						m_IndexData[Index] = *((uint8_t*)LinePtr);
+						Index++;
+						LinePtr++;
+					}
 					else if (m_BitmapHeader.BitCount == 8) {
 						uint32_t Color = *((uint8_t*)LinePtr);
 						m_BitmapData[Index].Red = ColorTable[Color].Red;
@@ -313,7 +367,10 @@ public:
 
 				if (Count > 0) {
 					Index = x + y * GetWidth();
-					for (int k = 0; k < Count; k++) {
+					for (int k = 0; k < Count && Indexed; k++) {
+						m_IndexData[Index + k] = ColorIndex;
+					}
+					for (int k = 0; k < Count && !Indexed; k++) {
 						m_BitmapData[Index + k].Red = ColorTable[ColorIndex].Red;
 						m_BitmapData[Index + k].Green = ColorTable[ColorIndex].Green;
 						m_BitmapData[Index + k].Blue = ColorTable[ColorIndex].Blue;
@@ -343,6 +400,10 @@ public:
 						Index = x + y * GetWidth();
 						for (int k = 0; k < Count; k++) {
 							file.read((char*)&ColorIndex, sizeof(uint8_t));
+							if (Indexed) {
+								m_IndexData[Index + k] = ColorIndex;
+								continue;
+							}
 							m_BitmapData[Index + k].Red = ColorTable[ColorIndex].Red;
 							m_BitmapData[Index + k].Green = ColorTable[ColorIndex].Green;
 							m_BitmapData[Index + k].Blue = ColorTable[ColorIndex].Blue;
@@ -400,10 +461,11 @@ public:
 			}
 		}
 
-		delete[] ColorTable;
+		if (!Indexed) {
+			delete[] ColorTable;
+		}
 		delete[] Line;
 
-		file.close();
 		return Result;
 	}
 
@@ -455,7 +517,24 @@ public:
 		bh.PelsPerMeterX = 3780;
 		bh.PelsPerMeterY = 3780;
 
-		if (BitCount == 32) {
+		if (BitCount == 8 && m_IndexData) {
+			/* Indexed images are written with their own color table rather than a generated one */
+			bh.ClrUsed = m_ColorTableSize;
+			bh.SizeImage = LineWidth * GetHeight();
+			bfh.BitsOffset += m_ColorTableSize * sizeof(BGRA);
+			bfh.Size = bfh.BitsOffset + bh.SizeImage;
+
+			file.write((char*)&bfh, BITMAP_FILEHEADER_SIZE);
+			file.write((char*)&bh, sizeof(BITMAP_HEADER));
+			file.write((char*)m_ColorTable, m_ColorTableSize * sizeof(BGRA));
+
+			uint8_t Padding[4] = { 0, 0, 0, 0 };
+			for (unsigned int i = 0; i < GetHeight(); i++) {
+				file.write((char*)m_IndexData + i * GetWidth(), GetWidth());
+				file.write((char*)Padding, LineWidth - GetWidth());
+			}
+		}
+		else if (BitCount == 32) {
 			file.write((char*)&bfh, sizeof(BITMAP_FILEHEADER));
 			file.write((char*)&bh, sizeof(BITMAP_HEADER));
 			file.write((char*)m_BitmapData, bh.SizeImage);
@@ -561,6 +640,24 @@ public:
 		return m_BitmapData;
 	}
 
+	/* Indexed images (see Load) keep palette indices instead of RGBA */
+
+	bool IsIndexed() {
+		return m_IndexData != 0;
+	}
+
+	uint8_t* GetIndices() {
+		return m_IndexData;
+	}
+
+	BGRA* GetColorTable() {
+		return m_ColorTable;
+	}
+
+	unsigned int GetColorTableSize() {
+		return m_ColorTableSize;
+	}
+
 	/* Copies internal RGBA buffer to user specified buffer and converts it into destination
 	 * bit format specified by component masks.
 	 *
@@ -746,6 +843,30 @@ public:
 		return Result;
 	}
 
+	/* Set Bitmap Bits as palette indices, one byte per pixel, with the color table they index into */
+
+	bool SetIndexedBits(const uint8_t* Buffer, unsigned int Width, unsigned int Height, const BGRA* Palette, unsigned int PaletteSize) {
+		if (Buffer == 0 || Palette == 0 || PaletteSize == 0 || PaletteSize > 256) {
+			return false;
+		}
+
+		Dispose();
+
+		m_BitmapHeader.Width = Width;
+		m_BitmapHeader.Height = Height;
+		m_BitmapHeader.BitCount = 8;
+
+		m_BitmapSize = GetWidth() * GetHeight();
+		m_IndexData = new uint8_t[m_BitmapSize];
+		memcpy(m_IndexData, Buffer, m_BitmapSize);
+
+		m_ColorTableSize = PaletteSize;
+		m_ColorTable = new BGRA[m_ColorTableSize];
+		memcpy(m_ColorTable, Palette, m_ColorTableSize * sizeof(BGRA));
+
+		return true;
+	}
+
 	/* Set Bitmap Bits. Will be converted to RGBA internally */
 
 	bool SetBits(void* Buffer, unsigned int Width, unsigned int Height, unsigned int RedMask, unsigned int GreenMask, unsigned int BlueMask, unsigned int AlphaMask = 0) {